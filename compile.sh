@@ -2,12 +2,20 @@
 
 # 编译token合约命令 compile.sh token
 # 编译store合约命令 compile.sh store
+# 编译并运行链下测试 compile.sh test
 
 if [ x"$1" = x ]; then 
   echo "请输入编译的合约名!"
   exit 1
 fi
 
+if [ x"$1" = xtest ]; then
+  for t in billing_tests varint_tests; do
+    g++ -std=c++17 -Wall -I store/tests/stub -I store/include -o ${t} ./store/tests/${t}.cpp && ./${t} || exit 1
+  done
+  exit 0
+fi
+
 echo "------------------------------------------------------------------ 开始编译${1}.mta ------------------------------------------------------------------"
 
 eosio-cpp -abigen -I store/include -I token/include -contract ${1} -o ${1}.wasm ./${1}/src/${1}.cpp
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <fixmath.hpp>
+
+/**
+ * 计费公式，只依赖传入的参数，不读写数据表
+ * 合约和链下测试使用同一份实现
+ */
+namespace billing {
+
+   using fixmath::rounding;
+
+   constexpr uint64_t milliseconds_in_one_day = 24 * 60 * 60 * 1000ull;
+   constexpr uint64_t milliseconds_in_one_year = milliseconds_in_one_day * 365;
+
+   constexpr uint64_t fee_cycle = milliseconds_in_one_day;    // 计费周期毫秒为单位
+
+   constexpr uint64_t one_gb = 64 * 1024;                     // 1GB，按16k一个分片
+
+   constexpr int64_t max_hdd_amount = (1LL << 62) - 1;
+
+   // hddm累计收益放大倍数
+   constexpr uint64_t hddm_acc_precision = 1000000000000ull;
+   // 默认每单位生产空间的周期收益 = 10^8 * (记账周期/1年) / 1GB，放大 hddm_acc_precision 倍
+   constexpr uint64_t default_profit_per_space = uint64_t( uint128_t(100000000) * hddm_acc_precision * fee_cycle / ( uint128_t(one_gb) * milliseconds_in_one_year ) );
+
+   inline bool is_hdd_amount_within_range( int64_t amount )
+   {
+      return -max_hdd_amount <= amount && amount <= max_hdd_amount;
+   }
+
+   // 余额 = 原余额 + (slot_t / fee_cycle) * (周期收益 - 周期费用)，slot_t = (current_time - last_update_time) / 1000，向零截断
+   inline int64_t calculate_balance( int64_t oldbalance, int64_t hdds_per_cycle_fee, int64_t hddm_per_cycle_profit, uint64_t last_update_time, uint64_t current_time )
+   {
+      uint64_t slot_t = ( current_time - last_update_time ) / 1000ll;
+      int128_t delta = fixmath::smuldiv( int128_t(hddm_per_cycle_profit) - hdds_per_cycle_fee, slot_t, fee_cycle, rounding::toward_zero );
+      int64_t new_balance = fixmath::to_int64( delta + oldbalance );
+
+      fixmath::check( is_hdd_amount_within_range( new_balance ), "magnitude of user hdds must be less than 2^62" );
+      return new_balance;
+   }
+
+   // 周期收益 = 生产空间 * 每单位生产空间的周期收益，与按全网累计值结算的收益速度一致，向零截断
+   // 默认收益率下即 (生产空间/1GB) * (记账周期/1年) * 10^8
+   inline int64_t calc_hddm_per_cycle_profit( uint64_t space, uint64_t profit_per_space )
+   {
+      return fixmath::to_int64( fixmath::muldiv( space, profit_per_space, hddm_acc_precision, rounding::toward_zero ) );
+   }
+
+   // 矿机计入收益账号生产空间的部分，不活跃（周期收益为0）的矿机不计入
+   // 收益账号的生产空间始终等于其活跃矿机的生产空间之和
+   inline uint64_t owner_counted_space( uint64_t prod_space, uint64_t hddm_per_cycle_profit )
+   {
+      return hddm_per_cycle_profit > 0 ? prod_space : 0;
+   }
+
+   // 矿机计入的生产空间从 before 变为 after 后收益账号的生产空间
+   inline uint64_t move_owner_space( uint64_t owner_space, uint64_t before, uint64_t after )
+   {
+      fixmath::check( owner_space >= before, "owner prod_space underflow" );
+      fixmath::check( after <= UINT64_MAX - ( owner_space - before ), "owner prod_space overflow" );
+      return owner_space - before + after;
+   }
+
+   // 矿机增加生产空间后的周期收益，已经停用的矿机保持不活跃，没有生产空间的新矿机变为活跃
+   inline int64_t calc_miner_profit_after_add( uint64_t prod_space, uint64_t hddm_per_cycle_profit, uint64_t space, uint64_t profit_per_space )
+   {
+      if ( prod_space > 0 && hddm_per_cycle_profit == 0 ) {
+         return 0;
+      }
+      return calc_hddm_per_cycle_profit( prod_space + space, profit_per_space );
+   }
+
+   // 购买hdd所需token = (amount/10^4) * (hdd价格/token价格)，向零截断，amount不是10^4整数倍时再加1
+   inline int64_t calc_buy_token_amount( int64_t amount, uint64_t hdd_price, uint64_t token_price )
+   {
+      fixmath::check( amount >= 0, "must use positive hdd amount" );
+      uint128_t token_amount = fixmath::muldiv( uint64_t(amount), hdd_price, uint128_t(10000) * token_price, rounding::toward_zero );
+      if ( amount % 10000 > 0 ) {
+         token_amount += 1;
+      }
+      return fixmath::to_int64( token_amount );
+   }
+
+   // 出售hdd获得token = (amount/10^4) * (hdd价格/token价格) * (去重系数/10^4) * (去重分配系数/10^4)，向零截断
+   inline int64_t calc_sell_token_amount( int64_t amount, uint64_t hdd_price, uint64_t token_price, uint64_t dup_remove_ratio, uint64_t dup_remove_dist_ratio )
+   {
+      fixmath::check( amount >= 0, "must use positive hdd amount" );
+      uint128_t num = fixmath::mul( fixmath::mul( fixmath::mul( uint64_t(amount), hdd_price ), dup_remove_ratio ), dup_remove_dist_ratio );
+      uint128_t den = fixmath::mul( token_price, uint128_t(1000000000000ll) );
+      return fixmath::to_int64( fixmath::div( num, den, rounding::toward_zero ) );
+   }
+
+   // 所需押金 = (空间/1GB) * (rate/100) * 10^4，向零截断
+   inline int64_t calc_deposit_required( uint64_t space, uint64_t rate )
+   {
+      return fixmath::to_int64( fixmath::muldiv( fixmath::mul( space, rate ), 100, one_gb, rounding::toward_zero ) );
+   }
+
+} // namespace billing
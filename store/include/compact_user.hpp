@@ -0,0 +1,43 @@
+#pragma once
+
+#include <varint.hpp>
+
+/**
+ * usersv2 表行的压缩编码，合约和链下测试使用同一份实现
+ * - 字段顺序与 user_v2 相同，时间为秒，按32位定长写入
+ * - 计数字段按变长整数编码，hdds 和 hddm 使用 zigzag 编码
+ * 新增字段只能追加在末尾
+ */
+namespace compact_user {
+
+   template<typename DataStream, typename U>
+   void pack( DataStream& ds, const U& u )
+   {
+      ds << u.owner;
+      varint::pack_i64( ds, u.hdds );
+      varint::pack_u64( ds, u.used_space );
+      varint::pack_u64( ds, u.hdds_per_cycle_fee );
+      ds << u.hdds_last_update_time;
+      varint::pack_i64( ds, u.hddm );
+      varint::pack_u64( ds, u.prod_space );
+      varint::pack_u64( ds, u.hddm_per_cycle_profit );
+      ds << u.hddm_last_update_time;
+      varint::pack_u64( ds, u.hddm_acc_snapshot );
+   }
+
+   template<typename DataStream, typename U>
+   void unpack( DataStream& ds, U& u )
+   {
+      ds >> u.owner;
+      u.hdds = varint::unpack_i64( ds );
+      u.used_space = varint::unpack_u64( ds );
+      u.hdds_per_cycle_fee = varint::unpack_u64( ds );
+      ds >> u.hdds_last_update_time;
+      u.hddm = varint::unpack_i64( ds );
+      u.prod_space = varint::unpack_u64( ds );
+      u.hddm_per_cycle_profit = varint::unpack_u64( ds );
+      ds >> u.hddm_last_update_time;
+      u.hddm_acc_snapshot = varint::unpack_u64( ds );
+   }
+
+} // namespace compact_user
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <eosio/eosio.hpp>
+
+/**
+ * 定点整数运算
+ * 合约中所有计费相关的计算都使用整数和128位中间值完成，不使用浮点数，
+ * 保证各节点结果一致，并避免wasm中软浮点的开销
+ */
+namespace fixmath {
+
+   using eosio::check;
+
+   /**
+    * 舍入方式
+    * - toward_zero 向零截断，与原先 (int64_t)double 的结果一致
+    * - away_from_zero 远离零进位
+    */
+   enum class rounding : uint8_t {
+      toward_zero    = 0,
+      away_from_zero = 1
+   };
+
+   static constexpr uint128_t uint128_max = ~uint128_t(0);
+
+   // 无符号乘法，溢出时报错
+   inline uint128_t mul( uint128_t a, uint128_t b )
+   {
+      check( b == 0 || a <= uint128_max / b, "fixed-point multiplication overflow" );
+      return a * b;
+   }
+
+   // 无符号除法，按指定方式舍入
+   inline uint128_t div( uint128_t num, uint128_t den, rounding mode )
+   {
+      check( den != 0, "fixed-point division by zero" );
+      uint128_t q = num / den;
+      uint128_t r = num % den;
+      if ( r == 0 ) {
+         return q;
+      }
+      switch ( mode ) {
+         case rounding::away_from_zero:
+            return q + 1;
+         default:
+            return q;
+      }
+   }
+
+   // a * b / c，无符号
+   inline uint128_t muldiv( uint128_t a, uint128_t b, uint128_t c, rounding mode )
+   {
+      return div( mul( a, b ), c, mode );
+   }
+
+   // a * b / c，a 可以为负数，舍入方向以绝对值为准
+   inline int128_t smuldiv( int128_t a, uint128_t b, uint128_t c, rounding mode )
+   {
+      bool negative = a < 0;
+      uint128_t abs_a = negative ? uint128_t(0) - uint128_t(a) : uint128_t(a);
+      uint128_t q = muldiv( abs_a, b, c, mode );
+      check( q <= uint128_t(~uint128_t(0) >> 1), "fixed-point result overflow" );
+      return negative ? -int128_t(q) : int128_t(q);
+   }
+
+   // 转换为int64，超出范围报错
+   inline int64_t to_int64( int128_t v )
+   {
+      check( v >= INT64_MIN && v <= INT64_MAX, "fixed-point result out of int64 range" );
+      return int64_t(v);
+   }
+
+   inline int64_t to_int64( uint128_t v )
+   {
+      check( v <= uint128_t(INT64_MAX), "fixed-point result out of int64 range" );
+      return int64_t(v);
+   }
+
+   inline uint64_t to_uint64( uint128_t v )
+   {
+      check( v <= uint128_t(UINT64_MAX), "fixed-point result out of uint64 range" );
+      return uint64_t(v);
+   }
+
+} // namespace fixmath
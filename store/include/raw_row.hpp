@@ -0,0 +1,55 @@
+#pragma once
+
+#include <eosio/eosio.hpp>
+
+#include <cstring>
+#include <vector>
+
+/**
+ * 按字节偏移直接读写数据表中一行的定长字段，不反序列化整行
+ * - 只用于读写频繁的定长字段，变长字段和二级索引用到的字段仍然通过 multi_index 修改
+ * - 同一个action中不要再通过 multi_index 修改同一行，否则会覆盖这里写入的数据
+ */
+class raw_row {
+   public:
+      raw_row( eosio::name code, uint64_t scope, eosio::name table, uint64_t pk )
+      {
+         _itr = eosio::internal_use_do_not_use::db_find_i64( code.value, scope, table.value, pk );
+         if ( _itr >= 0 ) {
+            auto size = eosio::internal_use_do_not_use::db_get_i64( _itr, nullptr, 0 );
+            _buf.resize( size );
+            eosio::internal_use_do_not_use::db_get_i64( _itr, _buf.data(), size );
+         }
+      }
+
+      bool exists() const { return _itr >= 0; }
+
+      uint32_t size() const { return _buf.size(); }
+
+      template<typename F>
+      F get( uint32_t offset ) const
+      {
+         eosio::check( offset + sizeof(F) <= _buf.size(), "raw row read out of range" );
+         F value;
+         memcpy( &value, _buf.data() + offset, sizeof(F) );
+         return value;
+      }
+
+      template<typename F>
+      void set( uint32_t offset, F value )
+      {
+         eosio::check( offset + sizeof(F) <= _buf.size(), "raw row write out of range" );
+         memcpy( _buf.data() + offset, &value, sizeof(F) );
+      }
+
+      // 写回整行，行长度不变
+      void store( eosio::name payer )
+      {
+         eosio::check( exists(), "raw row does not exist" );
+         eosio::internal_use_do_not_use::db_update_i64( _itr, payer.value, _buf.data(), _buf.size() );
+      }
+
+   private:
+      int32_t            _itr = -1;
+      std::vector<char>  _buf;
+};
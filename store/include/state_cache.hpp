@@ -0,0 +1,346 @@
+#pragma once
+
+#include <eosio/eosio.hpp>
+
+#include <map>
+#include <vector>
+
+/**
+ * action内的singleton缓存
+ * 第一次使用时读取一次，之后的读写都在内存中进行，action结束时如有修改只写回一次
+ */
+template<typename Singleton, typename T>
+class singleton_cache {
+   public:
+      explicit singleton_cache( eosio::name code ) : _code( code ) {}
+
+      // 只读访问
+      const T& get()
+      {
+         load();
+         return _value;
+      }
+
+      // 可修改访问，action结束时写回
+      T& modify()
+      {
+         load();
+         _dirty = true;
+         return _value;
+      }
+
+      // 是否已经初始化
+      bool exists()
+      {
+         return _loaded || Singleton( _code, _code.value ).exists();
+      }
+
+      // 有修改时写回
+      void flush()
+      {
+         if ( _dirty ) {
+            Singleton( _code, _code.value ).set( _value, _code );
+            _dirty = false;
+         }
+      }
+
+   private:
+      void load()
+      {
+         if ( !_loaded ) {
+            _value = Singleton( _code, _code.value ).get();
+            _loaded = true;
+         }
+      }
+
+      eosio::name _code;
+      T           _value;
+      bool        _loaded = false;
+      bool        _dirty = false;
+};
+
+/**
+ * action内的数据表行缓存
+ * 同一行在一个action中无论读取、修改多少次，只从表中读取一次，action结束时新增或修改的行只写入一次
+ * 接口与 multi_index 一致，行指针相当于迭代器，end() 为空指针
+ * 需要按二级索引遍历时使用 table()，遍历到的行再通过缓存读取和修改
+ */
+template<typename Table, typename T>
+class row_cache {
+   public:
+      explicit row_cache( eosio::name code ) : _table( code, code.value ) {}
+
+      Table& table() { return _table; }
+
+      const T* end() const { return nullptr; }
+
+      const T* find( uint64_t pk )
+      {
+         auto cached = _rows.find( pk );
+         if ( cached != _rows.end() ) {
+            return &cached->second.value;
+         }
+
+         auto itr = _table.find( pk );
+         if ( itr == _table.end() ) {
+            return nullptr;
+         }
+         return &_rows.emplace( pk, entry{ *itr, *itr, eosio::name(), row_state::clean } ).first->second.value;
+      }
+
+      const T* require_find( uint64_t pk, const char* error_msg )
+      {
+         const T* row = find( pk );
+         eosio::check( row != nullptr, error_msg );
+         return row;
+      }
+
+      template<typename Lambda>
+      const T* emplace( eosio::name payer, Lambda&& constructor )
+      {
+         T value{};
+         constructor( value );
+         uint64_t pk = value.primary_key();
+         eosio::check( _rows.find( pk ) == _rows.end(), "could not insert object, uniqueness constraint violated" );
+         return &_rows.emplace( pk, entry{ value, value, payer, row_state::added } ).first->second.value;
+      }
+
+      template<typename Lambda>
+      void modify( const T* row, eosio::name payer, Lambda&& updater )
+      {
+         eosio::check( row != nullptr, "cannot pass end iterator to modify" );
+         uint64_t pk = row->primary_key();
+         auto itr = _rows.find( pk );
+         eosio::check( itr != _rows.end(), "object passed to modify is not in cache" );
+         auto& cached = itr->second;
+         updater( cached.value );
+         eosio::check( pk == cached.value.primary_key(), "updater cannot change primary key when modifying an object" );
+         if ( payer != eosio::name() ) {
+            cached.payer = payer;
+         }
+         if ( cached.state == row_state::clean ) {
+            cached.state = row_state::modified;
+         }
+      }
+
+      // 删除立即生效，未写入的修改一并丢弃
+      void erase( const T* row )
+      {
+         eosio::check( row != nullptr, "cannot pass end iterator to erase" );
+         uint64_t pk = row->primary_key();
+         auto cached = _rows.find( pk );
+         eosio::check( cached != _rows.end(), "object passed to erase is not in cache" );
+         if ( cached->second.state != row_state::added ) {
+            _table.erase( _table.find( pk ) );
+            _erased.push_back( cached->second.original );
+         }
+         _rows.erase( cached );
+      }
+
+      // 写入新增和修改的行
+      void flush()
+      {
+         for ( auto& [pk, cached] : _rows ) {
+            if ( cached.state == row_state::added ) {
+               _table.emplace( cached.payer, [&]( auto& row ) {
+                  row = cached.value;
+               });
+            } else if ( cached.state == row_state::modified ) {
+               _table.modify( _table.find( pk ), cached.payer, [&]( auto& row ) {
+                  row = cached.value;
+               });
+            }
+            cached.original = cached.value;
+            cached.state = row_state::clean;
+            cached.payer = eosio::name();
+         }
+         _erased.clear();
+      }
+
+      // 遍历尚未写入的变化，f( 修改前, 修改后 )，新增的行修改前为空指针，删除的行修改后为空指针
+      template<typename F>
+      void for_each_change( F&& f ) const
+      {
+         for ( const auto& [pk, cached] : _rows ) {
+            if ( cached.state == row_state::added ) {
+               f( nullptr, &cached.value );
+            } else if ( cached.state == row_state::modified ) {
+               f( &cached.original, &cached.value );
+            }
+         }
+         for ( const auto& row : _erased ) {
+            f( &row, nullptr );
+         }
+      }
+
+   private:
+      enum class row_state : uint8_t {
+         clean    = 0,
+         added    = 1,
+         modified = 2
+      };
+
+      struct entry {
+         T           value;
+         T           original;   // 读取时的值
+         eosio::name payer;
+         row_state   state;
+      };
+
+      Table                       _table;
+      std::map<uint64_t, entry>   _rows;
+      std::vector<T>              _erased;
+};
+
+/**
+ * 新旧两种行格式并存时的数据表行缓存，接口与 row_cache 一致
+ * - 先在新表中查找，找不到再读取旧表，内存中统一使用旧表的行类型 T
+ * - 旧表中的行修改后仍写回旧表，由迁移action分批搬到新表；新增的行只写入新表
+ * - 新表的行类型 V 需要能从 T 构造，并通过 value() 转换为 T
+ */
+template<typename Table, typename V, typename LegacyTable, typename T>
+class versioned_row_cache {
+   public:
+      explicit versioned_row_cache( eosio::name code ) : _table( code, code.value ), _legacy( code, code.value ) {}
+
+      Table& table() { return _table; }
+
+      LegacyTable& legacy_table() { return _legacy; }
+
+      const T* end() const { return nullptr; }
+
+      const T* find( uint64_t pk )
+      {
+         auto cached = _rows.find( pk );
+         if ( cached != _rows.end() ) {
+            return &cached->second.value;
+         }
+
+         auto itr = _table.find( pk );
+         if ( itr != _table.end() ) {
+            T value = itr->value();
+            return &_rows.emplace( pk, entry{ value, value, eosio::name(), row_state::clean, false } ).first->second.value;
+         }
+
+         auto legacy_itr = _legacy.find( pk );
+         if ( legacy_itr != _legacy.end() ) {
+            return &_rows.emplace( pk, entry{ *legacy_itr, *legacy_itr, eosio::name(), row_state::clean, true } ).first->second.value;
+         }
+         return nullptr;
+      }
+
+      const T* require_find( uint64_t pk, const char* error_msg )
+      {
+         const T* row = find( pk );
+         eosio::check( row != nullptr, error_msg );
+         return row;
+      }
+
+      template<typename Lambda>
+      const T* emplace( eosio::name payer, Lambda&& constructor )
+      {
+         T value{};
+         constructor( value );
+         uint64_t pk = value.primary_key();
+         eosio::check( _rows.find( pk ) == _rows.end(), "could not insert object, uniqueness constraint violated" );
+         return &_rows.emplace( pk, entry{ value, value, payer, row_state::added, false } ).first->second.value;
+      }
+
+      template<typename Lambda>
+      void modify( const T* row, eosio::name payer, Lambda&& updater )
+      {
+         eosio::check( row != nullptr, "cannot pass end iterator to modify" );
+         uint64_t pk = row->primary_key();
+         auto itr = _rows.find( pk );
+         eosio::check( itr != _rows.end(), "object passed to modify is not in cache" );
+         auto& cached = itr->second;
+         updater( cached.value );
+         eosio::check( pk == cached.value.primary_key(), "updater cannot change primary key when modifying an object" );
+         if ( payer != eosio::name() ) {
+            cached.payer = payer;
+         }
+         if ( cached.state == row_state::clean ) {
+            cached.state = row_state::modified;
+         }
+      }
+
+      // 删除立即生效，未写入的修改一并丢弃
+      void erase( const T* row )
+      {
+         eosio::check( row != nullptr, "cannot pass end iterator to erase" );
+         uint64_t pk = row->primary_key();
+         auto cached = _rows.find( pk );
+         eosio::check( cached != _rows.end(), "object passed to erase is not in cache" );
+         if ( cached->second.state != row_state::added ) {
+            if ( cached->second.legacy ) {
+               _legacy.erase( _legacy.find( pk ) );
+            } else {
+               _table.erase( _table.find( pk ) );
+            }
+            _erased.push_back( cached->second.original );
+         }
+         _rows.erase( cached );
+      }
+
+      // 写入新增和修改的行
+      void flush()
+      {
+         for ( auto& [pk, cached] : _rows ) {
+            if ( cached.state == row_state::added ) {
+               _table.emplace( cached.payer, [&]( auto& row ) {
+                  row = V( cached.value );
+               });
+            } else if ( cached.state == row_state::modified ) {
+               if ( cached.legacy ) {
+                  _legacy.modify( _legacy.find( pk ), cached.payer, [&]( auto& row ) {
+                     row = cached.value;
+                  });
+               } else {
+                  _table.modify( _table.find( pk ), cached.payer, [&]( auto& row ) {
+                     row = V( cached.value );
+                  });
+               }
+            }
+            cached.original = cached.value;
+            cached.state = row_state::clean;
+            cached.payer = eosio::name();
+         }
+         _erased.clear();
+      }
+
+      // 遍历尚未写入的变化，用法与 row_cache::for_each_change 相同
+      template<typename F>
+      void for_each_change( F&& f ) const
+      {
+         for ( const auto& [pk, cached] : _rows ) {
+            if ( cached.state == row_state::added ) {
+               f( nullptr, &cached.value );
+            } else if ( cached.state == row_state::modified ) {
+               f( &cached.original, &cached.value );
+            }
+         }
+         for ( const auto& row : _erased ) {
+            f( &row, nullptr );
+         }
+      }
+
+   private:
+      enum class row_state : uint8_t {
+         clean    = 0,
+         added    = 1,
+         modified = 2
+      };
+
+      struct entry {
+         T           value;
+         T           original;   // 读取时的值
+         eosio::name payer;
+         row_state   state;
+         bool        legacy;
+      };
+
+      Table                       _table;
+      LegacyTable                 _legacy;
+      std::map<uint64_t, entry>   _rows;
+      std::vector<T>              _erased;
+};
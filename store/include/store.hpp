@@ -4,6 +4,11 @@
 #include <eosio/eosio.hpp>
 #include <eosio/system.hpp>
 #include <eosio/singleton.hpp>
+#include <eosio/binary_extension.hpp>
+
+#include <state_cache.hpp>
+#include <raw_row.hpp>
+#include <compact_user.hpp>
 
 #include <string>
 
@@ -25,15 +30,34 @@ using namespace eosio;
  */
 class [[eosio::contract("store")]] store : public contract {
    public:
-      using contract::contract;
+      store( name receiver, name code, datastream<const char*> ds )
+         : contract( receiver, code, ds ), _sysinfo( receiver ), _syscounter( receiver ), _netstats( receiver ),
+           _users( receiver ), _deposits( receiver ), _store_pools( receiver ), _miners( receiver ),
+           _miner_stats( receiver ) {}
+
+      // action结束时写回缓存的系统参数、统计数据和修改过的行
+      ~store()
+      {
+         update_netstats();
+         update_pool_stats();
+         update_delinquency();
+         _netstats.flush();
+         _sysinfo.flush();
+         _syscounter.flush();
+         _users.flush();
+         _deposits.flush();
+         _store_pools.flush();
+         _miners.flush();
+         _miner_stats.flush();
+      }
 
       static constexpr symbol CORE_SYMBOL = symbol(symbol_code("MTA"), 4);
 
       /**
-       * 重置数据，测试时使用
+       * 重置数据，测试时使用，每次最多删除 limit 行，重复执行直到完成
        */
       [[eosio::action]]
-      void sysreset();
+      void sysreset( uint64_t limit );
 
       /**********************************************************************************************
        *                                                                                            *
@@ -47,6 +71,18 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void sysinit();
 
+      /**
+       * 拆分旧版系统参数中的统计数据，升级合约后先执行，完成前不能修改系统参数
+       */
+      [[eosio::action]]
+      void migsysinfo();
+
+      /**
+       * 统计已有数据生成全网统计、矿池统计和欠费索引，每次最多统计 limit 行，升级合约后重复执行直到完成
+       */
+      [[eosio::action]]
+      void initstats( uint32_t limit );
+
       /**
        * 设置hdd价格
        */
@@ -83,6 +119,42 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void addhddcnt( int64_t count, uint8_t acc_type );
 
+      /**
+       * 设置每单位生产空间的周期收益
+       */
+      [[eosio::action]]
+      void setprofrate( uint64_t rate );
+
+      /**
+       * 设置每单位占用空间的存储周期费用，从当前时间开始生效
+       * 与 setunitfee 都按占用空间计费，设置了 unit fee 时只能设置为0
+       * 提价后需要执行 reindexdelq 重建欠费索引
+       */
+      [[eosio::action]]
+      void setfeeprice( uint64_t price );
+
+      /**
+       * 设置每单位占用空间的周期费用，设置后修改占用空间时自动计算用户的存储周期费用，为0时关闭
+       * 与 setfeeprice 都按占用空间计费，当前存储费用价格不为0时不能开启
+       */
+      [[eosio::action]]
+      void setunitfee( uint64_t fee );
+
+      /**
+       * 设置是否合并 HDD_ACCOUNT 转给用户的token，开启后记入待转账表，由 flushxfers 统一转账
+       * 待转的token只体现在 projbalance 的 pending_credit 和 get_pending_credit 中，用户向 HDD_ACCOUNT 付款时先抵扣；
+       * 不计入 token 合约的余额，转出之前不能用于 paydeppool 等按 token 余额检查的操作
+       */
+      [[eosio::action]]
+      void setxfermode( bool deferred );
+
+      /**
+       * 从 lower_bound 开始执行待转账表中的转账，每次最多处理 limit 行
+       * HDD_ACCOUNT 可用余额不足的行保留在表中跳过，输出的 next 为下一次处理的起点
+       */
+      [[eosio::action]]
+      void flushxfers( const name& lower_bound, uint32_t limit );
+
 
       /**********************************************************************************************
        *                                                                                            *
@@ -96,11 +168,52 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void buyhdd( const name& from, const name& receiver, int64_t amount, const string& memo );
 
+      /**
+       * 结算后的用户余额
+       */
+      struct balance_result {
+         name      owner;
+         int64_t   balance;
+      };
+
+      /**
+       * 批量结算的一页结果，next 为下一次调用的起点，全部结算完时为空
+       */
+      struct settle_page {
+         vector<balance_result>  balances;
+         name                    next;
+      };
+
       /**
        * 结算hdds的余额
        */
       [[eosio::action]]
-      void getbalance( const name& user, uint8_t acc_type, const name& caller );
+      balance_result getbalance( const name& user, uint8_t acc_type, const name& caller );
+
+      /**
+       * 批量结算hdds的余额，按输入顺序返回结算后的余额
+       */
+      [[eosio::action]]
+      vector<int64_t> batchsettle( const vector<name>& users, const name& caller );
+
+      /**
+       * 从 lower_bound 开始按用户表顺序批量结算最多 limit 个用户的hdds余额
+       */
+      [[eosio::action]]
+      settle_page settlefrom( const name& lower_bound, uint32_t limit, const name& caller );
+
+      /**
+       * 按预计耗尽时间从早到晚结算最多 limit 个余额已经耗尽的用户，返回结算后的余额
+       * 预计耗尽时间最多晚一个计费周期，setfeeprice 提价后 reindexdelq 完成前可能遗漏提前耗尽的用户
+       */
+      [[eosio::action]]
+      vector<balance_result> sweepdelinq( uint32_t limit, const name& caller );
+
+      /**
+       * setfeeprice 提价后按新价格重建欠费索引，每次最多 limit 个用户，重复执行直到 next 为空
+       */
+      [[eosio::action]]
+      settle_page reindexdelq( uint32_t limit, const name& caller );
 
       /**
        * 设置存储周期费用
@@ -126,6 +239,26 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void subhspace( const name& user, uint64_t space, const name& caller );
 
+      /**
+       * 批量修改用户占用空间时的一项，delta 为正增加，为负减少
+       */
+      struct space_delta {
+         name     user;
+         int64_t  delta;
+      };
+
+      /**
+       * 批量修改用户占用空间，同一用户的多项合并后只结算和写入一次
+       */
+      [[eosio::action]]
+      void batchhspace( const vector<space_delta>& entries, const name& caller );
+
+      /**
+       * 将旧版用户表中的行改写为压缩格式，每次最多迁移 limit 行
+       */
+      [[eosio::action]]
+      void migrateusers( uint64_t limit );
+
 
       /**********************************************************************************************
        *                                                                                            *
@@ -149,7 +282,7 @@ class [[eosio::contract("store")]] store : public contract {
        * 更新hddm收益
        */
       [[eosio::action]]
-      void calcprofit( const name& user );
+      balance_result calcprofit( const name& user );
 
       /**
        * 用户出售hdd
@@ -163,12 +296,41 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void addmprofit( const name& owner, uint64_t minerid, uint64_t space, const name& caller );
 
+      /**
+       * 批量采购矿机空间时的一项
+       */
+      struct miner_space {
+         uint64_t  minerid;
+         uint64_t  space;
+      };
+
+      /**
+       * 批量预采购矿机空间，每个收益账号只结算一次
+       */
+      [[eosio::action]]
+      void addmprofits( const vector<miner_space>& entries, const name& caller );
+
       /**
        * 添加矿机
        */
       [[eosio::action]]
       void newminer( uint64_t minerid, const name& adminacc, const name& dep_acc, asset dep_amount );
 
+      /**
+       * 批量添加矿机时的一项
+       */
+      struct new_miner {
+         uint64_t  minerid;
+         name      adminacc;
+         asset     dep_amount;
+      };
+
+      /**
+       * 批量添加矿机，押金全部由 dep_acc 支付
+       */
+      [[eosio::action]]
+      void newminers( const name& dep_acc, const vector<new_miner>& miners );
+
       /**
        * 删除矿机
        */
@@ -181,6 +343,13 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void calcmbalance( const name& owner, uint64_t minerid );
 
+      /**
+       * 将旧版矿机表拆分为 minerinfo 和 minerstats，每次最多迁移 limit 行
+       * 迁移完成前，单台矿机的操作在读取时迁移该矿机，按矿池或收益账号分页的操作不能执行
+       */
+      [[eosio::action]]
+      void migminers( uint64_t limit );
+
       /**
        * 矿机状态更改为不活跃，无收益
        */
@@ -205,6 +374,12 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void mchgowneracc( uint64_t minerid, const name& new_owneracc );
 
+      /**
+       * 将收益账号的矿机全部转给新的收益账号，每次最多处理 limit 台，重复执行直到完成
+       */
+      [[eosio::action]]
+      void mchgownerall( const name& old_owner, const name& new_owner, uint32_t limit );
+
       /**
        * 矿机修改抵押账号
        */
@@ -235,6 +410,21 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void payforfeit( const name& user, uint64_t minerid, asset quant, uint8_t acc_type, const name& caller );
 
+      /**
+       * 批量扣除罚金时的一项
+       */
+      struct miner_forfeit {
+         uint64_t  minerid;
+         asset     quant;
+      };
+
+      /**
+       * 矿机批量扣除罚金，每个抵押账号只转账一次
+       * acc_type 为2时 caller 必须是管理员账户之一并签名，否则需要合约账户签名
+       */
+      [[eosio::action]]
+      void payforfeits( const vector<miner_forfeit>& forfeits, uint8_t acc_type, const name& caller );
+
 
       /**********************************************************************************************
        *                                                                                            *
@@ -266,16 +456,118 @@ class [[eosio::contract("store")]] store : public contract {
       [[eosio::action]]
       void addm2pool( uint64_t minerid, const name& pool_id, const name& minerowner, uint64_t max_space );
 
+      /**
+       * 将矿池中的矿机迁移到另一个矿池，每次最多迁移 limit 台，重复执行直到迁移完成，需要 POOL_ADMIN 和目标矿池所有者签名
+       */
+      [[eosio::action]]
+      void migratepool( const name& from_pool, const name& to_pool, uint32_t limit );
+
+      /**
+       * 矿池中的矿机全部更改为不活跃，每次最多处理 limit 台，重复执行直到完成
+       */
+      [[eosio::action]]
+      void pooldeactive( const name& pool_id, uint32_t limit );
+
+      /**
+       * 矿池中的矿机全部更改为活跃，每次最多处理 limit 台，重复执行直到完成
+       */
+      [[eosio::action]]
+      void poolactive( const name& pool_id, uint32_t limit );
+
+
+      /**********************************************************************************************
+       *                                                                                            *
+       *                                            只读查询                                         *
+       *                                                                                            *
+       *********************************************************************************************/
+
+      /**
+       * 用户余额
+       * - hdds 结算到当前时间的hdds余额
+       * - hddm 结算到当前时间的hddm余额
+       * - pending_credit HDD_ACCOUNT 待转给用户的token
+       */
+      struct balance_info {
+         int64_t   hdds;
+         int64_t   hddm;
+         asset     pending_credit;
+      };
+
+      /**
+       * 用户表中保存的一行，不结算到当前时间
+       */
+      struct user_info {
+         name        owner;
+         int64_t     hdds;
+         uint64_t    used_space;
+         uint64_t    hdds_per_cycle_fee;
+         uint64_t    hdds_last_update_time;
+         int64_t     hddm;
+         uint64_t    prod_space;
+         uint64_t    hddm_per_cycle_profit;
+         uint64_t    hddm_last_update_time;
+         uint64_t    hddm_acc_snapshot;
+      };
+
+      /**
+       * 分页查询用户的一页结果，next 为下一次查询的起点，查询完时为空
+       */
+      struct user_page {
+         vector<user_info>  users;
+         name               next;
+      };
+
+      /**
+       * 从 lower_bound 开始按主键顺序查询最多 limit 个用户，两种格式的用户表都按完整字段返回
+       */
+      [[eosio::action, eosio::read_only]]
+      user_page listusers( const name& lower_bound, uint32_t limit );
+
+      /**
+       * 查询结算到当前时间的用户余额，不修改数据
+       */
+      [[eosio::action, eosio::read_only]]
+      balance_info projbalance( const name& user );
+
+      /**
+       * 查询购买 amount 数量hdd需要支付的token
+       */
+      [[eosio::action, eosio::read_only]]
+      asset quotebuy( int64_t amount );
+
+      /**
+       * 查询出售 amount 数量hddm获得的token
+       */
+      [[eosio::action, eosio::read_only]]
+      asset quotesell( int64_t amount );
+
+      /**
+       * 查询矿机最大空间为 max_space 时需要的押金
+       */
+      [[eosio::action, eosio::read_only]]
+      asset depositreq( uint64_t max_space );
+
 
       
 
-      // 获取抵押金额
+      // 获取抵押金额，只读取 deposit_total，不反序列化整行
       static asset get_deposit( const name& store_contract_account, const name& owner )
       {
-         deposits_table deposits( store_contract_account, store_contract_account.value );
-         const auto& deposit = deposits.find( owner.value );
-         if ( deposit != deposits.end()) {
-            return deposit->deposit_total;
+         raw_row deposit( store_contract_account, store_contract_account.value, "deposits"_n, owner.value );
+         if ( deposit.exists() ) {
+            return asset( deposit.get<int64_t>( deposit_offset::deposit_total ), CORE_SYMBOL );
+         } else {
+            return asset( 0, CORE_SYMBOL );
+         }
+      }
+
+      // 获取 HDD_ACCOUNT 待转给用户的token
+      static asset get_pending_credit( const name& store_contract_account, const name& owner )
+      {
+         pending_xfers_table pending_xfers( store_contract_account, store_contract_account.value );
+         auto pending = pending_xfers.find( owner.value );
+         if ( pending != pending_xfers.end() ) {
+            return pending->amount;
          } else {
             return asset( 0, CORE_SYMBOL );
          }
@@ -286,20 +578,33 @@ class [[eosio::contract("store")]] store : public contract {
 
       // 系统设置
       using sysinit_action      = action_wrapper<"sysinit"_n, &store::sysinit>;
+      using migsysinfo_action   = action_wrapper<"migsysinfo"_n, &store::migsysinfo>;
+      using initstats_action    = action_wrapper<"initstats"_n, &store::initstats>;
       using sethddprice_action  = action_wrapper<"sethddprice"_n, &store::sethddprice>;
       using settokprice_action  = action_wrapper<"settokprice"_n, &store::settokprice>;
       using setrate_action      = action_wrapper<"setrate"_n, &store::setrate>;
       using setdrratio_action   = action_wrapper<"setdrratio"_n, &store::setdrratio>;
       using setdrdratio_action  = action_wrapper<"setdrdratio"_n, &store::setdrdratio>;
       using addhddcnt_action    = action_wrapper<"addhddcnt"_n, &store::addhddcnt>;
+      using setprofrate_action  = action_wrapper<"setprofrate"_n, &store::setprofrate>;
+      using setfeeprice_action  = action_wrapper<"setfeeprice"_n, &store::setfeeprice>;
+      using setunitfee_action   = action_wrapper<"setunitfee"_n, &store::setunitfee>;
+      using setxfermode_action  = action_wrapper<"setxfermode"_n, &store::setxfermode>;
+      using flushxfers_action   = action_wrapper<"flushxfers"_n, &store::flushxfers>;
 
       // 用户
       using buyhdd_action       = action_wrapper<"buyhdd"_n, &store::buyhdd>;
       using getbalance_action   = action_wrapper<"getbalance"_n, &store::getbalance>;
+      using batchsettle_action  = action_wrapper<"batchsettle"_n, &store::batchsettle>;
+      using settlefrom_action   = action_wrapper<"settlefrom"_n, &store::settlefrom>;
+      using sweepdelinq_action  = action_wrapper<"sweepdelinq"_n, &store::sweepdelinq>;
+      using reindexdelq_action  = action_wrapper<"reindexdelq"_n, &store::reindexdelq>;
       using sethfee_action      = action_wrapper<"sethfee"_n, &store::sethfee>;
       using subbalance_action   = action_wrapper<"subbalance"_n, &store::subbalance>;
       using addhspace_action    = action_wrapper<"addhspace"_n, &store::addhspace>;
       using subhspace_action    = action_wrapper<"subhspace"_n, &store::subhspace>;
+      using batchhspace_action  = action_wrapper<"batchhspace"_n, &store::batchhspace>;
+      using migrateusers_action = action_wrapper<"migrateusers"_n, &store::migrateusers>;
       using paydeppool_action   = action_wrapper<"paydeppool"_n, &store::paydeppool>;
       using unpaydeppool_action = action_wrapper<"unpaydeppool"_n, &store::unpaydeppool>;
       using calcprofit_action   = action_wrapper<"calcprofit"_n, &store::calcprofit>;
@@ -307,18 +612,23 @@ class [[eosio::contract("store")]] store : public contract {
       // 矿工
       using sellhdd_action      = action_wrapper<"sellhdd"_n, &store::sellhdd>;
       using addmprofit_action   = action_wrapper<"addmprofit"_n, &store::addmprofit>;
+      using addmprofits_action  = action_wrapper<"addmprofits"_n, &store::addmprofits>;
       using newminer_action     = action_wrapper<"newminer"_n, &store::newminer>;
+      using newminers_action    = action_wrapper<"newminers"_n, &store::newminers>;
       using delminer_action     = action_wrapper<"delminer"_n, &store::delminer>;
       using calcmbalance_action = action_wrapper<"calcmbalance"_n, &store::calcmbalance>;
+      using migminers_action    = action_wrapper<"migminers"_n, &store::migminers>;
       using mdeactive_action    = action_wrapper<"mdeactive"_n, &store::mdeactive>;
       using mactive_action      = action_wrapper<"mactive"_n, &store::mactive>;
       using mchgadminacc_action = action_wrapper<"mchgadminacc"_n, &store::mchgadminacc>;
       using mchgowneracc_action = action_wrapper<"mchgowneracc"_n, &store::mchgowneracc>;
+      using mchgownerall_action = action_wrapper<"mchgownerall"_n, &store::mchgownerall>;
       using mchgstrpool_action  = action_wrapper<"mchgstrpool"_n, &store::mchgstrpool>;
       using mchgspace_action    = action_wrapper<"mchgspace"_n, &store::mchgspace>;
       // using paydeposit_action   = action_wrapper<"paydeposit"_n, &store::paydeposit>;
       using chgdeposit_action   = action_wrapper<"chgdeposit"_n, &store::chgdeposit>;
       using payforfeit_action   = action_wrapper<"payforfeit"_n, &store::payforfeit>;
+      using payforfeits_action  = action_wrapper<"payforfeits"_n, &store::payforfeits>;
       using mchgdepacc_action   = action_wrapper<"mchgdepacc"_n, &store::mchgdepacc>;
 
       // 矿池
@@ -326,13 +636,52 @@ class [[eosio::contract("store")]] store : public contract {
       using delstrpool_action   = action_wrapper<"delstrpool"_n, &store::delstrpool>;
       using chgpoolspace_action = action_wrapper<"chgpoolspace"_n, &store::chgpoolspace>;
       using addm2pool_action    = action_wrapper<"addm2pool"_n, &store::addm2pool>;
+      using migratepool_action  = action_wrapper<"migratepool"_n, &store::migratepool>;
+      using pooldeactive_action = action_wrapper<"pooldeactive"_n, &store::pooldeactive>;
+      using poolactive_action   = action_wrapper<"poolactive"_n, &store::poolactive>;
+
+      // 查询
+      using listusers_action    = action_wrapper<"listusers"_n, &store::listusers>;
+      using projbalance_action  = action_wrapper<"projbalance"_n, &store::projbalance>;
+      using quotebuy_action     = action_wrapper<"quotebuy"_n, &store::quotebuy>;
+      using quotesell_action    = action_wrapper<"quotesell"_n, &store::quotesell>;
+      using depositreq_action   = action_wrapper<"depositreq"_n, &store::depositreq>;
 
    private:
 
       
 
       /**
-       * 系统设置信息
+       * sysreset 按顺序清空的数据表
+       */
+      struct reset_stage {
+         static constexpr uint8_t users       = 0;
+         static constexpr uint8_t users_v2    = 1;
+         static constexpr uint8_t deposits    = 2;
+         static constexpr uint8_t miners      = 3;
+         static constexpr uint8_t miner_stats = 4;
+         static constexpr uint8_t miners_v1   = 5;
+         static constexpr uint8_t store_pools = 6;
+         static constexpr uint8_t fee_epochs  = 7;
+         static constexpr uint8_t pool_cursors = 8;
+         static constexpr uint8_t pending_xfers = 9;
+         static constexpr uint8_t delinquency = 10;
+         static constexpr uint8_t done        = 11;
+      };
+
+      /**
+       * sysreset 的进度，重置完成后删除
+       * - stage 正在清空的数据表
+       * - erased 已删除的行数
+       */
+      struct [[eosio::table]] reset_state {
+         uint8_t   stage = 0;
+         uint64_t  erased = 0;
+      };
+      typedef singleton< "resetstate"_n, reset_state > reset_state_singleton;
+
+      /**
+       * 系统设置信息，只在管理员设置参数时修改
        */
       struct [[eosio::table]] sysinfo {
          name      admin = "store.mta"_n;                       // 管理员账号
@@ -341,23 +690,156 @@ class [[eosio::contract("store")]] store : public contract {
          uint64_t  rate = 400;                                  // token和空间兑换比率
          uint64_t  dup_remove_ratio = 10000;                    // 去重系数
          uint64_t  dup_remove_dist_ratio = 10000;               // 去重分配系数
+      };
+      typedef singleton< "sysinfo"_n, sysinfo > sysinfo_singleton;
+
+      /**
+       * 可选的计费和转账模式，不存在时全部关闭
+       * 单独保存而不追加到 sysinfo，避免 migsysinfo 之前把旧版 sysinfo 末尾的统计数据当作设置读取
+       */
+      struct [[eosio::table]] sysopts {
+         uint64_t  hdds_unit_fee = 0;                           // 每单位占用空间的周期费用，放大 hdds_fee_precision 倍
+         bool      defer_transfers = false;                     // HDD_ACCOUNT 转给用户的token是否记入待转账表
+      };
+      typedef singleton< "sysopts"_n, sysopts > sysopts_singleton;
+
+      /**
+       * 系统统计数据，购买hdd、注册矿机和开户时修改
+       */
+      struct [[eosio::table]] syscounter {
          uint64_t  miner_count = 0;                             // 矿机统计
          uint64_t  user_count = 0;                              // 存储用户统计
          int64_t   hdd_counter = 2 * 1024 * 1024 * 100000000ll; // 系统中hdd余额
       };
-      typedef singleton< "sysinfo"_n, sysinfo > sysinfo_singleton;
+      typedef singleton< "syscounter"_n, syscounter > syscounter_singleton;
+
+      /**
+       * initstats 按顺序统计的数据表
+       */
+      struct netstats_stage {
+         static constexpr uint8_t users    = 0;
+         static constexpr uint8_t deposits = 1;
+         static constexpr uint8_t miners   = 2;
+         static constexpr uint8_t done     = 3;
+      };
+
+      /**
+       * 全网统计数据，action结束时按用户表和抵押表中修改过的行增量更新
+       * - used_space 用户占用空间总量
+       * - prod_space 用户生产空间总量
+       * - hdds 用户hdds余额总量，按各用户上次结算时的余额统计
+       * - hddm 用户hddm余额总量，按各用户上次结算时的余额统计
+       * - deposit_used 已使用押金总量
+       * - stage、cursor initstats 的进度，统计完成前只累计已经统计过的行的变化
+       */
+      struct [[eosio::table]] netstats {
+         uint64_t  used_space = 0;
+         uint64_t  prod_space = 0;
+         int64_t   hdds = 0;
+         int64_t   hddm = 0;
+         int64_t   deposit_used = 0;
+
+         uint8_t   stage = netstats_stage::done;
+         uint64_t  cursor = 0;
+      };
+      typedef singleton< "netstats"_n, netstats > netstats_singleton;
+
+      /**
+       * 旧版系统设置信息，只用于 migsysinfo 迁移
+       */
+      struct sysinfo_v1 {
+         name      admin;
+         uint64_t  hdd_price;
+         uint64_t  token_price;
+         uint64_t  rate;
+         uint64_t  dup_remove_ratio;
+         uint64_t  dup_remove_dist_ratio;
+         uint64_t  miner_count;
+         uint64_t  user_count;
+         int64_t   hdd_counter;
+      };
+
+      /**
+       * 全网hddm收益累计值
+       * - acc 截至 last_update_time 每单位生产空间的累计收益
+       * - last_update_time 上次修改收益率的时间
+       * - profit_per_space 每单位生产空间的周期收益
+       * acc 和 profit_per_space 均放大 hddm_acc_precision 倍
+       */
+      struct [[eosio::table]] hddm_acc {
+         uint64_t  acc = 0;
+         uint64_t  last_update_time = 0;
+         uint64_t  profit_per_space = 0;
+      };
+      typedef singleton< "hddmacc"_n, hddm_acc > hddm_acc_singleton;
+
+      /**
+       * 存储费用价格表，每次调价新增一行
+       * - start_time 生效时间
+       * - price 每单位占用空间的周期费用
+       * - acc_fee start_time 之前每单位占用空间的累计费用
+       * price 和 acc_fee 均放大 hdds_fee_precision 倍
+       */
+      struct [[eosio::table]] fee_epoch {
+         uint64_t  start_time;
+         uint64_t  price = 0;
+         uint64_t  acc_fee = 0;
+
+         uint64_t primary_key() const { return start_time; }
+      };
+      typedef multi_index< "feeepochs"_n, fee_epoch > fee_epochs_table;
+
+      /**
+       * 待转账表，HDD_ACCOUNT 应转给用户但尚未转出的token
+       * - owner 用户账户
+       * - amount 待转金额
+       */
+      struct [[eosio::table]] pending_xfer {
+         name      owner;
+         asset     amount = asset(0, CORE_SYMBOL);
+
+         uint64_t primary_key() const { return owner.value; }
+      };
+      typedef multi_index< "pendxfers"_n, pending_xfer > pending_xfers_table;
+
+      /**
+       * 欠费索引，只包含hdds余额会耗尽或已经耗尽的用户，action结束时按修改过的用户更新
+       * - owner 用户账户
+       * - exhaust_time 按上次结算后的余额、周期费用和当前存储费用价格预计余额耗尽的时间
+       * 尚未到期时，变化不超过一个计费周期不改写；存储费用提价后由 reindexdelq 按新价格重建
+       */
+      struct [[eosio::table]] delinquency {
+         name      owner;
+         uint64_t  exhaust_time = 0;
+
+         uint64_t primary_key() const { return owner.value; }
+         uint64_t by_exhaust_time() const { return exhaust_time; }
+      };
+      typedef multi_index< "delinquency"_n, delinquency,
+         indexed_by< "exhausttime"_n, const_mem_fun<delinquency, uint64_t, &delinquency::by_exhaust_time> >
+      > delinquency_table;
+
+      /**
+       * reindexdelq 的进度，setfeeprice 提价时创建，重建完成后删除
+       * - cursor 下一个要重建的用户
+       */
+      struct [[eosio::table]] delinq_reindex {
+         uint64_t  cursor = 0;
+      };
+      typedef singleton< "dqreindex"_n, delinq_reindex > delinq_reindex_singleton;
 
       /**
-       * 用户表
+       * 用户表，旧版格式，只读写尚未迁移到 usersv2 的行，也是合约内使用的用户数据结构
        * - owner 用户账户
        * - hdds 存储用hdd余额
        * - usedspace 使用空间
        * - hdds_last_update_time 上次更新hdds时间
        * - hdds_per_cycle_fee 存储周期费用
        * - hddm 挖矿挖到的hdd余额
-       * - prod_space 生产空间
-       * - hddm_per_cycle_profit 收益周期费用
+       * - prod_space 生产空间，等于该账号活跃矿机的生产空间之和，停用的矿机不计入
+       * - hddm_per_cycle_profit 收益周期费用，按最后一次修改时的收益率计算，setprofrate 后不随之更新，hddm 按全网累计值结算
        * - hddm_last_update_time 上次更新hddm时间
+       * - hddm_acc_snapshot 上次结算hddm时的全网累计收益
        */
       struct [[eosio::table]] user {
         name        owner;
@@ -372,10 +854,79 @@ class [[eosio::contract("store")]] store : public contract {
         uint64_t    hddm_per_cycle_profit = 0;
         uint64_t    hddm_last_update_time;
 
+        binary_extension<uint64_t> hddm_acc_snapshot;
+
         uint64_t primary_key() const { return owner.value; }
       };
       typedef multi_index< "users"_n, user> users_table;
 
+      /**
+       * 用户表压缩格式
+       * - 时间精确到秒，用32位保存
+       * - 计数字段按变长整数编码，hdds 和 hddm 可能为负数，使用 zigzag 编码
+       * 编码见 compact_user.hpp，新增字段只能追加在末尾，读取时按剩余字节判断是否存在，与 binary_extension 相同。
+       * 变长编码无法用ABI描述，因此不生成ABI表定义，链下通过 listusers 读取
+       */
+      struct user_v2 {
+         name        owner;
+
+         int64_t     hdds = 0;
+         uint64_t    used_space = 0;
+         uint64_t    hdds_per_cycle_fee = 0;
+         uint32_t    hdds_last_update_time = 0;
+
+         int64_t     hddm = 0;
+         uint64_t    prod_space = 0;
+         uint64_t    hddm_per_cycle_profit = 0;
+         uint32_t    hddm_last_update_time = 0;
+         uint64_t    hddm_acc_snapshot = 0;
+
+         user_v2() {}
+
+         explicit user_v2( const user& u )
+            : owner( u.owner ), hdds( u.hdds ), used_space( u.used_space ), hdds_per_cycle_fee( u.hdds_per_cycle_fee ),
+              hdds_last_update_time( uint32_t( u.hdds_last_update_time / 1000 ) ),
+              hddm( u.hddm ), prod_space( u.prod_space ), hddm_per_cycle_profit( u.hddm_per_cycle_profit ),
+              hddm_last_update_time( uint32_t( u.hddm_last_update_time / 1000 ) )
+         {
+            check( u.hddm_acc_snapshot.has_value(), "user must be settled before packing" );
+            hddm_acc_snapshot = u.hddm_acc_snapshot.value();
+         }
+
+         user value() const
+         {
+            user u;
+            u.owner                 = owner;
+            u.hdds                  = hdds;
+            u.used_space            = used_space;
+            u.hdds_per_cycle_fee    = hdds_per_cycle_fee;
+            u.hdds_last_update_time = uint64_t( hdds_last_update_time ) * 1000;
+            u.hddm                  = hddm;
+            u.prod_space            = prod_space;
+            u.hddm_per_cycle_profit = hddm_per_cycle_profit;
+            u.hddm_last_update_time = uint64_t( hddm_last_update_time ) * 1000;
+            u.hddm_acc_snapshot.emplace( hddm_acc_snapshot );
+            return u;
+         }
+
+         uint64_t primary_key() const { return owner.value; }
+
+         template<typename DataStream>
+         friend DataStream& operator<<( DataStream& ds, const user_v2& u )
+         {
+            compact_user::pack( ds, u );
+            return ds;
+         }
+
+         template<typename DataStream>
+         friend DataStream& operator>>( DataStream& ds, user_v2& u )
+         {
+            compact_user::unpack( ds, u );
+            return ds;
+         }
+      };
+      typedef multi_index< "usersv2"_n, user_v2 > users_v2_table;
+
       /**
        * 抵押表
        * - owner 用户账户名
@@ -393,12 +944,34 @@ class [[eosio::contract("store")]] store : public contract {
       };
       typedef multi_index< "deposits"_n, deposit> deposits_table;
 
+      /**
+       * deposits 表中定长字段的字节偏移，asset 取 amount 的位置
+       */
+      struct deposit_offset {
+         static constexpr uint32_t deposit_total = 8;
+         static constexpr uint32_t deposit_used  = 24;
+         static constexpr uint32_t deposit_his   = 40;
+      };
+
+      /**
+       * 矿池中矿机的汇总数据，action结束时按修改过的矿机增量更新
+       * - miner_count 矿机数量
+       * - active_space 活跃矿机的生产空间
+       * - hddm_per_cycle_profit 矿机周期收益之和，与矿机的周期收益一样按各矿机最后一次修改时的收益率计算
+       */
+      struct pool_stat {
+         uint64_t  miner_count = 0;
+         uint64_t  active_space = 0;
+         uint64_t  hddm_per_cycle_profit = 0;
+      };
+
       /**
        * 矿池表
        * - pid 矿池id
        * - admin 矿池管理员
        * - max_space 配额
        * - prod_space 已使用配额
+       * - stats 矿池统计，没有时按0处理，initstats 完成前不完整
        */
       struct [[eosio::table]] store_pool {
          name            id;
@@ -407,6 +980,8 @@ class [[eosio::contract("store")]] store : public contract {
          uint64_t        prod_space = 0;
          uint8_t         pool_type = 0;              // 暂时没用
 
+         binary_extension<pool_stat> stats;
+
          uint64_t primary_key() const { return id.value; }
          uint64_t by_owner()  const { return owner.value; }
       };
@@ -415,7 +990,27 @@ class [[eosio::contract("store")]] store : public contract {
       > store_pools_table;
 
       /**
-       * 矿机表
+       * 矿池批量操作的进度
+       * - pool_id 矿池id
+       * - op 正在进行的操作，见 pool_op
+       * - next_minerid 下一台要处理的矿机
+       */
+      struct [[eosio::table]] pool_cursor {
+         name      pool_id;
+         uint8_t   op = 0;
+         uint64_t  next_minerid = 0;
+
+         uint64_t primary_key() const { return pool_id.value; }
+      };
+      typedef multi_index< "poolcursors"_n, pool_cursor > pool_cursors_table;
+
+      struct pool_op {
+         static constexpr uint8_t deactive = 1;
+         static constexpr uint8_t active   = 2;
+      };
+
+      /**
+       * 矿机表，只保存矿机的身份、抵押和配额信息，很少修改，二级索引与旧版矿机表相同
        * - mid 矿机id
        * - owner 收益账号
        * - admin 管理员账号
@@ -423,10 +1018,6 @@ class [[eosio::contract("store")]] store : public contract {
        * - deposit 抵押的资产
        * - poolid 所属矿池id
        * - max_space 最大空间
-       * - space_left 剩余空间
-       * - hddm_per_cycle_profit 周期收益
-       * - hddm_last_update_time 最后一次计算收益时间
-       * - total_profit 累计收益
        */
       struct [[eosio::table]] miner {
          uint64_t    id;
@@ -438,12 +1029,7 @@ class [[eosio::contract("store")]] store : public contract {
          asset       deposit = asset(0, CORE_SYMBOL);
          asset       dep_total = asset(0, CORE_SYMBOL);
 
-         uint64_t    prod_space = 0;
          uint64_t    max_space = 0;
-
-         uint64_t    hddm_per_cycle_profit = 0;
-         uint64_t    hddm_last_update_time;
-         uint64_t    total_profit = 0;
          
          uint64_t  primary_key() const { return id; }
          uint64_t  by_owner()  const { return owner.value; }
@@ -451,12 +1037,83 @@ class [[eosio::contract("store")]] store : public contract {
          uint64_t  by_depacc() const { return depacc.value; }
          uint64_t  by_poolid() const { return pool_id.value; }
       };
-      typedef multi_index< "miners"_n, miner,
+      typedef multi_index< "minerinfo"_n, miner,
          indexed_by< "owner"_n, const_mem_fun<miner, uint64_t, &miner::by_owner> >,
          indexed_by< "admin"_n, const_mem_fun<miner, uint64_t, &miner::by_admin> >,
          indexed_by< "poolid"_n, const_mem_fun<miner, uint64_t, &miner::by_poolid> >
       > miners_table;
 
+      /**
+       * minerinfo 表中定长字段的字节偏移，供 raw_row 使用
+       */
+      struct miner_offset {
+         static constexpr uint32_t owner = 8;
+      };
+
+      /**
+       * 矿机收益表，每次结算都会修改，与 minerinfo 按矿机id一一对应，没有二级索引
+       * - prod_space 生产空间
+       * - hddm_per_cycle_profit 周期收益，为0时矿机不活跃，按最后一次修改时的收益率计算，setprofrate 后不随之更新，收益按全网累计值结算
+       * - hddm_last_update_time 最后一次计算收益时间
+       * - total_profit 累计收益
+       * - hddm_acc_snapshot 上次结算收益时的全网累计收益
+       */
+      struct [[eosio::table]] miner_stat {
+         uint64_t    id;
+         uint64_t    prod_space = 0;
+         uint64_t    hddm_per_cycle_profit = 0;
+         uint64_t    hddm_last_update_time = 0;
+         uint64_t    total_profit = 0;
+         uint64_t    hddm_acc_snapshot = 0;
+
+         uint64_t  primary_key() const { return id; }
+      };
+      typedef multi_index< "minerstats"_n, miner_stat > miner_stats_table;
+
+      /**
+       * minerstats 表中定长字段的字节偏移，供 raw_row 使用
+       */
+      struct miner_stat_offset {
+         static constexpr uint32_t prod_space            = 8;
+         static constexpr uint32_t hddm_per_cycle_profit = 16;
+         static constexpr uint32_t hddm_last_update_time = 24;
+         static constexpr uint32_t total_profit          = 32;
+         static constexpr uint32_t hddm_acc_snapshot     = 40;
+      };
+
+      /**
+       * 旧版矿机表，只用于 migminers 迁移和 sysreset
+       */
+      struct miner_v1 {
+         uint64_t    id;
+         name        owner;
+         name        admin;
+         name        pool_id;
+         
+         name        depacc;
+         asset       deposit;
+         asset       dep_total;
+
+         uint64_t    prod_space;
+         uint64_t    max_space;
+
+         uint64_t    hddm_per_cycle_profit;
+         uint64_t    hddm_last_update_time;
+         uint64_t    total_profit;
+
+         binary_extension<uint64_t> hddm_acc_snapshot;
+         
+         uint64_t  primary_key() const { return id; }
+         uint64_t  by_owner()  const { return owner.value; }
+         uint64_t  by_admin()  const { return admin.value; }
+         uint64_t  by_poolid() const { return pool_id.value; }
+      };
+      typedef multi_index< "miners"_n, miner_v1,
+         indexed_by< "owner"_n, const_mem_fun<miner_v1, uint64_t, &miner_v1::by_owner> >,
+         indexed_by< "admin"_n, const_mem_fun<miner_v1, uint64_t, &miner_v1::by_admin> >,
+         indexed_by< "poolid"_n, const_mem_fun<miner_v1, uint64_t, &miner_v1::by_poolid> >
+      > miners_v1_table;
+
 
 
       /**
@@ -464,6 +1121,21 @@ class [[eosio::contract("store")]] store : public contract {
        */
       void systransfer( const name& from, const name& to, const asset& quantity, const string& memo );
 
+      /**
+       * HDD_ACCOUNT 可以转出的token数量
+       */
+      int64_t hdd_account_available();
+
+      /**
+       * HDD_ACCOUNT 转给用户，开启合并转账时记入待转账表
+       */
+      void pay_from_hdd_account( const name& to, const asset& quantity, const string& memo );
+
+      /**
+       * 用户转给 HDD_ACCOUNT，先抵扣待转账表中的金额，不足部分立即转账
+       */
+      void pay_to_hdd_account( const name& from, const asset& quantity, const string& memo );
+
       /**
        * 开通账户
        */
@@ -472,20 +1144,115 @@ class [[eosio::contract("store")]] store : public contract {
       // 验证管理员账户
       void check_admin_account( name admin_acc, uint64_t id, bool isCheckId );
 
-      // 结算hdd余额
-      void update_hdd_balance( users_table& users, const name& acc, bool is_hdds );
+      // 按主键顺序合并遍历两种格式的用户表，从 lower_bound 开始最多 limit 行，返回下一行的主键，遍历完时返回0
+      template<typename F>
+      uint64_t for_each_user( uint64_t lower_bound, uint32_t limit, F&& f );
+
+      // 该行是否已经计入全网统计或矿池统计
+      bool netstats_counted( uint8_t stage, uint64_t pk );
+
+      // 按本次action中修改过的用户和抵押更新全网统计
+      void update_netstats();
+
+      // 按本次action中修改过的矿机更新所属矿池的统计
+      void update_pool_stats();
+
+      // 按本次action中修改过的用户更新欠费索引
+      void update_delinquency();
+
+      // 将一台旧版矿机迁移到 minerinfo 和 minerstats，返回旧表中的下一行
+      miners_v1_table::const_iterator migrate_miner( miners_v1_table& miners_v1, miners_v1_table::const_iterator itr, uint64_t acc_now, uint64_t now );
+
+      // 读取矿机，还在旧版矿机表中时先迁移，不存在时返回 end()
+      const miner* find_miner( uint64_t minerid );
+      const miner* require_find_miner( uint64_t minerid, const char* error_msg );
+
+      // 旧版矿机表迁移完成前报错
+      void check_miners_migrated();
+
+      // 更新一个用户的欠费索引，余额不会耗尽时删除
+      void set_delinquency( delinquency_table& delinquencies, const user& row, uint64_t price, uint64_t now );
+
+      // 当前存储费用价格
+      uint64_t current_fee_price( const fee_epochs_table& epochs ) const;
+
+      // 预计hdds余额耗尽的时间，不会耗尽时返回 UINT64_MAX
+      uint64_t projected_exhaust_time( const user& row, uint64_t price ) const;
+
+      // 结算hdd余额，返回结算后的余额
+      int64_t update_hdd_balance( const name& acc, bool is_hdds );
+
+      // 截至 time 每单位占用空间的累计存储费用
+      uint64_t hdds_fee_acc_at( const fee_epochs_table& epochs, uint64_t time ) const;
+
+      // 结算后的hdds余额，包括用户周期费用和按占用空间计算的费用
+      int64_t settled_hdds( int64_t hdds, uint64_t used_space, uint64_t fee, uint64_t last_update_time, const fee_epochs_table& epochs, uint64_t fee_acc_now, uint64_t now );
+
+      // 结算用户hdds
+      void settle_user_hdds( user& row, const fee_epochs_table& epochs, uint64_t fee_acc_now, uint64_t now );
 
       // 计算hdd余额
       int64_t calculate_balance( int64_t oldbalance, int64_t hdds_per_cycle_fee, int64_t hddm_per_cycle_profit, uint64_t last_update_time, uint64_t current_time );
 
-      // 更新矿机收益
-      void update_miner_hddm_balance( miners_table& miners, uint64_t minerid );
+      // 当前每单位生产空间的周期收益
+      uint64_t current_profit_per_space() const;
+
+      // 修改系统参数，旧版 sysinfo 迁移前报错
+      sysinfo& modify_sysinfo();
+
+      // 可选模式设置，没有设置时返回默认值
+      sysopts get_sysopts() const;
+
+      // 当前每单位生产空间的累计收益
+      uint64_t current_hddm_acc( uint64_t now ) const;
+
+      // 生产空间在累计收益从 snapshot 增长到 acc_now 期间的收益
+      uint128_t accrued_hddm( uint64_t space, uint64_t acc_now, uint64_t snapshot ) const;
+
+      // 按全网累计收益结算用户hddm
+      void settle_user_hddm( user& row, uint64_t acc_now, uint64_t now );
+
+      // 按全网累计收益结算矿机收益
+      void settle_miner_hddm( miner_stat& row, uint64_t acc_now, uint64_t now );
+
+      // 更新收益账号计入的矿机生产空间，并按当前收益率重新计算周期收益
+      void update_owner_space( user& row, uint64_t before, uint64_t after, uint64_t profit_per_space );
+
+      // 分页修改矿池中矿机的活跃状态
+      void set_pool_miners_active( const name& pool_id, uint32_t limit, bool active );
 
       // 获取矿池所有者
       name get_miner_pool_owner( name poolid );
 
       // 抵押是否足够
-      bool is_deposit_enough( asset deposit, uint64_t space ) const;
+      bool is_deposit_enough( asset deposit, uint64_t space );
+
+      // 根据生产空间和当前收益率计算周期收益
+      int64_t calc_hddm_per_cycle_profit( uint64_t space, uint64_t profit_per_space ) const;
+
+      // 购买hdd需要支付的token数量
+      int64_t calc_buy_token_amount( int64_t amount, const sysinfo& sinfo ) const;
+
+      // 出售hdd获得的token数量
+      int64_t calc_sell_token_amount( int64_t amount, const sysinfo& sinfo ) const;
+
+      // 按占用空间计算存储周期费用
+      uint64_t calc_hdds_per_cycle_fee( uint64_t used_space, uint64_t unit_fee ) const;
+
+      // 空间所需的押金数量
+      int64_t calc_deposit_required( uint64_t space, uint64_t rate ) const;
+
+      // 当前action内缓存的系统参数和统计数据
+      singleton_cache< sysinfo_singleton, sysinfo > _sysinfo;
+      singleton_cache< syscounter_singleton, syscounter > _syscounter;
+      singleton_cache< netstats_singleton, netstats > _netstats;
+
+      // 当前action内缓存的数据表行
+      versioned_row_cache< users_v2_table, user_v2, users_table, user > _users;
+      row_cache< deposits_table, deposit >        _deposits;
+      row_cache< store_pools_table, store_pool >  _store_pools;
+      row_cache< miners_table, miner >            _miners;
+      row_cache< miner_stats_table, miner_stat >  _miner_stats;
 
       // 修改抵押
       void change_deposit_total( const name& owner, bool is_add, asset quant );
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <eosio/eosio.hpp>
+
+/**
+ * 变长整数编码，用于压缩数据表行中通常远小于上限的计数字段
+ * - 无符号数按 LEB128 编码，每字节7位，最高位表示后面还有字节
+ * - 有符号数先做 zigzag 转换，绝对值小的负数同样只占很少的字节
+ */
+namespace varint {
+
+   template<typename DataStream>
+   void pack_u64( DataStream& ds, uint64_t v )
+   {
+      do {
+         char b = char( v & 0x7f );
+         v >>= 7;
+         if ( v != 0 ) {
+            b |= char( 0x80 );
+         }
+         ds.write( &b, 1 );
+      } while ( v != 0 );
+   }
+
+   template<typename DataStream>
+   uint64_t unpack_u64( DataStream& ds )
+   {
+      uint64_t v = 0;
+      uint32_t shift = 0;
+      char b;
+      do {
+         eosio::check( shift < 64, "varint overflow" );
+         ds.read( &b, 1 );
+         v |= uint64_t( uint8_t(b) & 0x7f ) << shift;
+         shift += 7;
+      } while ( uint8_t(b) & 0x80 );
+      return v;
+   }
+
+   template<typename DataStream>
+   void pack_i64( DataStream& ds, int64_t v )
+   {
+      pack_u64( ds, ( uint64_t(v) << 1 ) ^ uint64_t( v >> 63 ) );
+   }
+
+   template<typename DataStream>
+   int64_t unpack_i64( DataStream& ds )
+   {
+      uint64_t u = unpack_u64( ds );
+      return int64_t( ( u >> 1 ) ^ ( ~( u & 1 ) + 1 ) );
+   }
+
+} // namespace varint
@@ -1,16 +1,23 @@
 #include <store.hpp>
 #include <token.hpp>
-
-const uint64_t hours_in_one_day = 24;
-const uint64_t minutes_in_one_day = hours_in_one_day * 60;
-const uint64_t milliseconds_in_one_day = minutes_in_one_day * 60 * 1000;
-const uint64_t milliseconds_in_one_year = milliseconds_in_one_day * 365;
-
-const uint64_t fee_cycle = milliseconds_in_one_day; // 计费周期毫秒为单位
-
+#include <fixmath.hpp>
+#include <billing.hpp>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+
+using fixmath::rounding;
+using billing::milliseconds_in_one_year;
+using billing::fee_cycle;
+using billing::one_gb;
+using billing::max_hdd_amount;
+using billing::hddm_acc_precision;
+using billing::default_profit_per_space;
+using billing::is_hdd_amount_within_range;
 
 // 以下空间量按照16k一个分片大小为单位
-const uint64_t one_gb = 64 * 1024;                                         // 1GB
 const uint64_t max_user_space = one_gb * 1024 * uint64_t(1024 * 500);      // 500P 最大用户存储空间量
 const uint64_t max_profit_space = one_gb * 1024 * uint64_t(1024 * 500);    // 500P 收益账号最大的生产空间上限
 const uint64_t max_pool_space = one_gb * 1024 * uint64_t(1024 * 500);      // 500P 矿池配额最大上限
@@ -19,6 +26,9 @@ const uint64_t min_miner_space = 100 * one_gb;                             // 10
 const int64_t  max_buy_sell_hdd_amount = 2* 1024 * 1024 * 100000000ll;     // 2P   单次买卖最大的HDD数量   
 const int64_t  min_buy_hdd_amount = 2 * 100000000ll;                       // 2    单次购买的最小的HDD数量  
 
+// 存储费用价格放大倍数
+const uint64_t hdds_fee_precision = 1000000000000ull;
+
 // 管理员账户列表
 const name admins[5] = {
   "admin1.mta"_n,
@@ -29,55 +39,131 @@ const name admins[5] = {
 };
 
 
-static constexpr int64_t max_hdd_amount = (1LL << 62) - 1;
-
 // 当前时间毫秒
 inline uint64_t current_time() {
   // return block_timestamp();
   return current_time_point().time_since_epoch().count() / 1000;
 }
 
-inline bool is_hdd_amount_within_range( int64_t amount )
+// 从表头开始删除最多 limit 行，返回删除的行数
+template<typename Table>
+static uint64_t erase_rows( Table& table, uint64_t limit )
 {
-  return -max_hdd_amount <= amount && amount <= max_hdd_amount;
+  uint64_t count = 0;
+  auto itr = table.begin();
+  while ( itr != table.end() && count < limit ) {
+    itr = table.erase( itr );
+    count++;
+  }
+  return count;
 }
 
 // 重置表数据，测试时使用
-void store::sysreset()
+// 每次最多删除 limit 行，按顺序逐个清空数据表，进度保存在 resetstate 中，所有表清空后再删除系统参数
+void store::sysreset( uint64_t limit )
 {
   require_auth( get_self() );
+  check( limit > 0, "limit must be positive" );
+
+  reset_state_singleton reset_state( get_self(), get_self().value );
+  auto state = reset_state.get_or_default();
+
+  uint64_t erased = 0;
+  while ( state.stage < reset_stage::done && erased < limit ) {
+    uint64_t count = 0;
+    switch ( state.stage ) {
+      case reset_stage::users: {
+        users_table users( get_self(), get_self().value );
+        count = erase_rows( users, limit - erased );
+        break;
+      }
+      case reset_stage::users_v2: {
+        users_v2_table users_v2( get_self(), get_self().value );
+        count = erase_rows( users_v2, limit - erased );
+        break;
+      }
+      case reset_stage::deposits: {
+        deposits_table deposits( get_self(), get_self().value );
+        count = erase_rows( deposits, limit - erased );
+        break;
+      }
+      case reset_stage::miners: {
+        miners_table miners( get_self(), get_self().value );
+        count = erase_rows( miners, limit - erased );
+        break;
+      }
+      case reset_stage::miner_stats: {
+        miner_stats_table miner_stats( get_self(), get_self().value );
+        count = erase_rows( miner_stats, limit - erased );
+        break;
+      }
+      case reset_stage::miners_v1: {
+        miners_v1_table miners_v1( get_self(), get_self().value );
+        count = erase_rows( miners_v1, limit - erased );
+        break;
+      }
+      case reset_stage::store_pools: {
+        store_pools_table store_pools( get_self(), get_self().value );
+        count = erase_rows( store_pools, limit - erased );
+        break;
+      }
+      case reset_stage::fee_epochs: {
+        fee_epochs_table fee_epochs( get_self(), get_self().value );
+        count = erase_rows( fee_epochs, limit - erased );
+        break;
+      }
+      case reset_stage::pool_cursors: {
+        pool_cursors_table pool_cursors( get_self(), get_self().value );
+        count = erase_rows( pool_cursors, limit - erased );
+        break;
+      }
+      case reset_stage::pending_xfers: {
+        pending_xfers_table pending_xfers( get_self(), get_self().value );
+        count = erase_rows( pending_xfers, limit - erased );
+        break;
+      }
+      case reset_stage::delinquency: {
+        delinquency_table delinquencies( get_self(), get_self().value );
+        count = erase_rows( delinquencies, limit - erased );
+        break;
+      }
+    }
+    erased += count;
+    state.erased += count;
 
-  // 清空表 users_table
-  users_table users( get_self(), get_self().value );
-  auto user_itr = users.begin();
-  while ( user_itr != users.end() ) {
-    user_itr = users.erase( user_itr );
+    // 删除的行数不足说明当前表已清空
+    if ( erased < limit ) {
+      state.stage++;
+    }
   }
 
-  // 清空表 deposits_table
-  deposits_table deposits( get_self(), get_self().value );
-  auto deposit_itr = deposits.begin();
-  while ( deposit_itr != deposits.end() ) {
-    deposit_itr = deposits.erase( deposit_itr );
+  if ( state.stage < reset_stage::done ) {
+    reset_state.set( state, get_self() );
+    print( "{\"stage\":", uint32_t(state.stage), ",\"erased\":", state.erased, ",\"done\":false}" );
+    return;
   }
 
-  // 清空表 miners_table
-  miners_table miners( get_self(), get_self().value );
-  auto miner_itr = miners.begin();
-  while ( miner_itr != miners.end() ) {
-    miner_itr = miners.erase( miner_itr );
-  }
+  // 清空系统参数
+  sysinfo_singleton sys_info( get_self(), get_self().value );
+  sys_info.remove();
 
-  // 清空表 store_pools_table
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool_itr = store_pools.begin();
-  while ( store_pool_itr != store_pools.end() ) {
-    store_pool_itr = store_pools.erase( store_pool_itr );
-  }
+  syscounter_singleton sys_counter( get_self(), get_self().value );
+  sys_counter.remove();
 
-  // 清空系统参数
-  sysinfo_singleton _sysinfo( get_self(), get_self().value );
-  _sysinfo.remove();
+  sysopts_singleton sys_opts( get_self(), get_self().value );
+  sys_opts.remove();
+
+  hddm_acc_singleton _hddm_acc( get_self(), get_self().value );
+  _hddm_acc.remove();
+
+  netstats_singleton net_stats( get_self(), get_self().value );
+  net_stats.remove();
+
+  delinq_reindex_singleton reindex( get_self(), get_self().value );
+  reindex.remove();
+
+  reset_state.remove();
+  print( "{\"stage\":", uint32_t(state.stage), ",\"erased\":", state.erased, ",\"done\":true}" );
 }
 
 
@@ -94,9 +180,115 @@ void store::sysinit()
   require_auth( get_self() );
 
   // 初始化全局参数
-  sysinfo_singleton _sysinfo( get_self(), get_self().value );
-  check( !_sysinfo.exists(), "the system is inited, can't init second time" );
-  _sysinfo.set( sysinfo{}, get_self() );
+  sysinfo_singleton sys_info( get_self(), get_self().value );
+  check( !sys_info.exists(), "the system is inited, can't init second time" );
+  sys_info.set( sysinfo{}, get_self() );
+
+  syscounter_singleton sys_counter( get_self(), get_self().value );
+  sys_counter.set( syscounter{}, get_self() );
+
+  netstats_singleton net_stats( get_self(), get_self().value );
+  net_stats.set( netstats{}, get_self() );
+}
+
+// 将旧版sysinfo中的统计数据拆分到syscounter，升级合约后执行一次
+void store::migsysinfo()
+{
+  require_auth( get_self() );
+
+  syscounter_singleton sys_counter( get_self(), get_self().value );
+  check( !sys_counter.exists(), "sysinfo is already migrated" );
+
+  singleton< "sysinfo"_n, sysinfo_v1 > sys_info_old( get_self(), get_self().value );
+  auto old = sys_info_old.get();
+
+  sys_counter.set( syscounter{ old.miner_count, old.user_count, old.hdd_counter }, get_self() );
+
+  sysinfo_singleton sys_info( get_self(), get_self().value );
+  sys_info.set( sysinfo{ old.admin, old.hdd_price, old.token_price, old.rate, old.dup_remove_ratio, old.dup_remove_dist_ratio }, get_self() );
+}
+
+// 统计已有的用户和抵押生成全网统计，升级合约后分批执行直到完成
+void store::initstats( uint32_t limit )
+{
+  require_auth( get_self() );
+  check( limit > 0, "limit must be positive" );
+
+  netstats_singleton net_stats( get_self(), get_self().value );
+  if ( !net_stats.exists() ) {
+    net_stats.set( netstats{ 0, 0, 0, 0, 0, netstats_stage::users, 0 }, get_self() );
+  }
+
+  auto& stats = _netstats.modify();
+  check( stats.stage != netstats_stage::done, "netstats is already built" );
+
+  uint32_t count = 0;
+  if ( stats.stage == netstats_stage::users ) {
+    // 同时建立欠费索引
+    fee_epochs_table fee_epochs( get_self(), get_self().value );
+    uint64_t price = current_fee_price( fee_epochs );
+    uint64_t tmp_t = current_time();
+    delinquency_table delinquencies( get_self(), get_self().value );
+    stats.cursor = for_each_user( stats.cursor, limit, [&]( uint64_t pk ) {
+      auto user = _users.find( pk );
+      stats.used_space += user->used_space;
+      stats.prod_space += user->prod_space;
+      stats.hdds += user->hdds;
+      stats.hddm += user->hddm;
+      set_delinquency( delinquencies, *user, price, tmp_t );
+      count++;
+    });
+    if ( stats.cursor == 0 ) {
+      stats.stage = netstats_stage::deposits;
+    }
+  }
+
+  if ( stats.stage == netstats_stage::deposits && count < limit ) {
+    auto& deposits = _deposits.table();
+    auto itr = deposits.lower_bound( stats.cursor );
+    for ( ; itr != deposits.end() && count < limit; ++itr, ++count ) {
+      stats.deposit_used += itr->deposit_used.amount;
+    }
+    if ( itr == deposits.end() ) {
+      stats.stage = netstats_stage::miners;
+      stats.cursor = 0;
+    } else {
+      stats.cursor = itr->primary_key();
+    }
+  }
+
+  // 矿机按所属矿池计入矿池统计
+  if ( stats.stage == netstats_stage::miners && count < limit ) {
+    auto& miners = _miners.table();
+    auto itr = miners.lower_bound( stats.cursor );
+    for ( ; itr != miners.end() && count < limit; ++itr, ++count ) {
+      if ( itr->pool_id.value == 0 ) {
+        continue;
+      }
+      auto store_pool = _store_pools.find( itr->pool_id.value );
+      if ( store_pool == _store_pools.end() ) {
+        continue;
+      }
+      auto stat = _miner_stats.require_find( itr->id, "minerid not register" );
+      _store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
+        auto pool_stats = row.stats.value_or();
+        pool_stats.miner_count += 1;
+        if ( stat->hddm_per_cycle_profit > 0 ) {
+          pool_stats.active_space += stat->prod_space;
+          pool_stats.hddm_per_cycle_profit += stat->hddm_per_cycle_profit;
+        }
+        row.stats.emplace( pool_stats );
+      });
+    }
+    if ( itr == miners.end() ) {
+      stats.stage = netstats_stage::done;
+      stats.cursor = 0;
+    } else {
+      stats.cursor = itr->primary_key();
+    }
+  }
+
+  print( "{\"stage\":", uint32_t(stats.stage), ",\"done\":", stats.stage == netstats_stage::done ? "true" : "false", "}" );
 }
 
 // 设置hdd价格
@@ -106,11 +298,9 @@ void store::sethddprice( uint64_t price )
 
   check( price > 0, "invalid price" );
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
+  auto& sinfo = modify_sysinfo();
   check( sinfo.hdd_price != price, "Can't set same hdd price" );
   sinfo.hdd_price = price;
-  sys_info.set( sinfo, get_self() );
 }
 
 // 设置token价格
@@ -124,12 +314,10 @@ void store::settokprice( uint64_t price, uint8_t acc_type )
     require_auth( get_self() );
   }
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
+  auto& sinfo = modify_sysinfo();
   check( price > 0, "invalid price" );
   check( sinfo.token_price != price, "Can't set same token price" );
   sinfo.token_price = price;
-  sys_info.set( sinfo, get_self() );
 }
 
 // 设置空间和token的比率
@@ -137,11 +325,9 @@ void store::setrate( int64_t rate )
 {
   require_auth( SUPER_ADMIN );
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
+  auto& sinfo = modify_sysinfo();
   check( sinfo.rate != rate, "Can't set same rate" );
   sinfo.rate = rate;
-  sys_info.set( sinfo, get_self() );
 }
 
 // 设置去重比率
@@ -157,11 +343,9 @@ void store::setdrratio( uint64_t ratio, uint8_t acc_type )
 
   check( ratio > 0 && ratio <= 10000, "invalid deduplication distribute ratio" );
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
+  auto& sinfo = modify_sysinfo();
   check( sinfo.dup_remove_ratio != ratio, "Can't set same dup_remove_ratio" );
   sinfo.dup_remove_ratio = ratio;
-  sys_info.set( sinfo, get_self() );
 }
 
 // 去重分配系数
@@ -171,11 +355,9 @@ void store::setdrdratio( uint64_t ratio )
 
   check( ratio >= 10000, "invalid deduplication ratio" );
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
+  auto& sinfo = modify_sysinfo();
   check( sinfo.dup_remove_dist_ratio != ratio, "Can't set same dup_remove_dist_ratio" );
   sinfo.dup_remove_dist_ratio = ratio;
-  sys_info.set( sinfo, get_self() );
 }
 
 // 修改hdd供应量，添加hdds供应量
@@ -189,10 +371,123 @@ void store::addhddcnt( int64_t count, uint8_t acc_type )
     require_auth( get_self() );
   }
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
-  sinfo.hdd_counter += count;
-  sys_info.set( sinfo, get_self() );
+  auto& counter = _syscounter.modify();
+  counter.hdd_counter += count;
+}
+
+// 设置每单位生产空间的周期收益，只需要结算全网累计值，不需要逐个结算用户
+void store::setprofrate( uint64_t rate )
+{
+  require_auth( SUPER_ADMIN );
+
+  hddm_acc_singleton _hddm_acc( get_self(), get_self().value );
+  auto acc = _hddm_acc.get_or_default( hddm_acc{ 0, 0, default_profit_per_space } );
+  check( acc.profit_per_space != rate, "Can't set same profit rate" );
+
+  uint64_t tmp_t = current_time();
+  acc.acc = current_hddm_acc( tmp_t );
+  acc.last_update_time = tmp_t;
+  acc.profit_per_space = rate;
+  _hddm_acc.set( acc, get_self() );
+}
+
+// 设置每单位占用空间的存储周期费用，新增一个价格区间，用户余额在结算时按区间分段计算
+void store::setfeeprice( uint64_t price )
+{
+  require_auth( SUPER_ADMIN );
+
+  // 占用空间已经按 unit fee 计入用户的周期费用，不能重复收取
+  check( price == 0 || get_sysopts().hdds_unit_fee == 0, "unit fee is set, used_space is already charged by hdds_per_cycle_fee" );
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t acc_fee = hdds_fee_acc_at( fee_epochs, tmp_t );
+
+  auto last = fee_epochs.end();
+  uint64_t old_price = 0;
+  if ( last != fee_epochs.begin() ) {
+    --last;
+    check( last->price != price, "Can't set same fee price" );
+    old_price = last->price;
+  } else {
+    check( price > 0, "invalid price" );
+  }
+
+  if ( last != fee_epochs.end() && last->start_time == tmp_t ) {
+    fee_epochs.modify( last, same_payer, [&]( auto &row ) {
+      row.price = price;
+    });
+  } else {
+    fee_epochs.emplace( get_self(), [&]( auto &row ) {
+      row.start_time = tmp_t;
+      row.price      = price;
+      row.acc_fee    = acc_fee;
+    });
+  }
+
+  // 提价后用户提前耗尽，欠费索引中的预计耗尽时间偏晚，需要 reindexdelq 按新价格重建
+  // 降价后预计耗尽时间偏早，sweepdelinq 只是提前结算，不需要重建
+  if ( price > old_price ) {
+    delinq_reindex_singleton reindex( get_self(), get_self().value );
+    reindex.set( delinq_reindex{ 0 }, get_self() );
+  }
+}
+
+// 设置每单位占用空间的周期费用，已有用户的周期费用在下次修改占用空间时更新
+void store::setunitfee( uint64_t fee )
+{
+  require_auth( SUPER_ADMIN );
+
+  sysopts_singleton sys_opts( get_self(), get_self().value );
+  auto opts = sys_opts.get_or_default();
+  check( opts.hdds_unit_fee != fee, "Can't set same unit fee" );
+
+  // 占用空间已经按价格区间计费，不能重复收取
+  if ( fee > 0 ) {
+    fee_epochs_table fee_epochs( get_self(), get_self().value );
+    check( current_fee_price( fee_epochs ) == 0, "fee price is set, used_space is already charged by fee epochs" );
+  }
+  opts.hdds_unit_fee = fee;
+  sys_opts.set( opts, get_self() );
+}
+
+// 设置是否合并 HDD_ACCOUNT 转给用户的token，关闭后已记录的金额仍需 flushxfers 转出
+void store::setxfermode( bool deferred )
+{
+  require_auth( SUPER_ADMIN );
+
+  sysopts_singleton sys_opts( get_self(), get_self().value );
+  auto opts = sys_opts.get_or_default();
+  check( opts.defer_transfers != deferred, "Can't set same transfer mode" );
+  opts.defer_transfers = deferred;
+  sys_opts.set( opts, get_self() );
+}
+
+// 执行待转账表中的转账，只转出已经欠用户的金额，任何账户都可以触发
+// 转账失败会回滚整个action，因此先按 HDD_ACCOUNT 的可用余额检查，余额不足的行保留在表中跳过，不影响之后的行
+void store::flushxfers( const name& lower_bound, uint32_t limit )
+{
+  check( limit > 0, "limit must be positive" );
+
+  pending_xfers_table pending_xfers( get_self(), get_self().value );
+  int64_t available = hdd_account_available();
+  auto itr = pending_xfers.lower_bound( lower_bound.value );
+  uint32_t count = 0;
+  uint32_t flushed = 0;
+  while ( itr != pending_xfers.end() && count < limit ) {
+    if ( itr->amount.amount > available ) {
+      ++itr;
+    } else {
+      available -= itr->amount.amount;
+      systransfer( HDD_ACCOUNT, itr->owner, itr->amount, "sell hddm" );
+      itr = pending_xfers.erase( itr );
+      flushed++;
+    }
+    count++;
+  }
+
+  bool done = itr == pending_xfers.end();
+  print( "{\"flushed\":", flushed, ",\"skipped\":", count - flushed, ",\"next\":\"", done ? string() : itr->owner.to_string(), "\",\"done\":", done ? "true" : "false", "}" );
 }
 
 
@@ -218,40 +513,33 @@ void store::buyhdd( const name& from, const name& receiver, int64_t amount, cons
   check( is_hdd_amount_within_range( amount ), "magnitude of amount must be less than 2^62" );
 
   // 2.获取相关配置
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
-  check( sinfo.hdd_counter >= amount, "hdd_counter overdrawn" );
-  sinfo.hdd_counter -= amount;
-  sys_info.set( sinfo, get_self() );
+  const auto& sinfo = _sysinfo.get();
+  auto& counter = _syscounter.modify();
+  check( counter.hdd_counter >= amount, "hdd_counter overdrawn" );
+  counter.hdd_counter -= amount;
 
-  int64_t delta = 0;
-  if( amount%10000 > 0 ) {
-    delta = 1;
-  }
-  int64_t _token_amount =(int64_t)( ((double)amount/10000) * ((double)sinfo.hdd_price/(double)sinfo.token_price) );
-  _token_amount += delta;
+  int64_t _token_amount = calc_buy_token_amount( amount, sinfo );
 
   // 3.调用token的方法扣除对应token
   asset quant{ _token_amount, CORE_SYMBOL };
-  systransfer( from, HDD_ACCOUNT, quant, "buy " + to_string( amount ) + " hdd" );
+  pay_to_hdd_account( from, quant, "buy " + to_string( amount ) + " hdd" );
 
   // 4.给当前用户增加相应hdd
-  users_table users( get_self(), get_self().value );
-  auto user = users.find( receiver.value );
+  auto user = _users.find( receiver.value );
 
-  if ( user == users.end() ) {
+  if ( user == _users.end() ) {
     create_user( receiver, from );
-    user = users.find( receiver.value );
+    user = _users.find( receiver.value );
   }
 
-  users.modify( user, same_payer, [&]( auto &row ){
+  _users.modify( user, same_payer, [&]( auto &row ){
     row.hdds += amount;
     check( is_hdd_amount_within_range( row.hdds ), "magnitude of user hdds must be less than 2^62" );      
   });
 }
 
 // 更新hdds的余接口
-void store::getbalance( const name& user, uint8_t acc_type, const name& caller )
+store::balance_result store::getbalance( const name& user, uint8_t acc_type, const name& caller )
 {
   check( is_account( user ), "user not a account." );
 
@@ -264,8 +552,109 @@ void store::getbalance( const name& user, uint8_t acc_type, const name& caller )
     require_auth( get_self() );
   }
 
-  users_table users( get_self(), get_self().value );
-  update_hdd_balance( users, user, true );
+  return balance_result{ user, update_hdd_balance( user, true ) };
+}
+
+// 批量结算hdds余额，所有用户使用同一个结算时间，按输入顺序返回结算后的余额
+vector<int64_t> store::batchsettle( const vector<name>& users, const name& caller )
+{
+  check( is_account( caller ), "caller not a account." );
+  check_admin_account( caller, 0, false );
+  check( !users.empty(), "users is empty" );
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+
+  vector<int64_t> balances;
+  balances.reserve( users.size() );
+  for ( const auto& acc : users ) {
+    auto user = _users.require_find( acc.value, "the user is not create" );
+    _users.modify( user, same_payer, [&]( auto &row ) {
+      settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
+    });
+    balances.push_back( user->hdds );
+  }
+  return balances;
+}
+
+// 按主键顺序批量结算hdds余额，两种格式的用户表按主键合并遍历，返回下一次调用的起点
+store::settle_page store::settlefrom( const name& lower_bound, uint32_t limit, const name& caller )
+{
+  check( is_account( caller ), "caller not a account." );
+  check_admin_account( caller, 0, false );
+  check( limit > 0, "limit must be positive" );
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+
+  settle_page page;
+  page.next = name( for_each_user( lower_bound.value, limit, [&]( uint64_t pk ) {
+    auto user = _users.find( pk );
+    _users.modify( user, same_payer, [&]( auto &row ) {
+      settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
+    });
+    page.balances.push_back( balance_result{ user->owner, user->hdds } );
+  }) );
+  return page;
+}
+
+// 按欠费索引结算余额已经耗尽的用户，只遍历预计耗尽时间已过的用户
+// 结算后仍然欠费的用户预计耗尽时间变为本次结算时间，排到其他欠费用户之后
+vector<store::balance_result> store::sweepdelinq( uint32_t limit, const name& caller )
+{
+  check( is_account( caller ), "caller not a account." );
+  check_admin_account( caller, 0, false );
+  check( limit > 0, "limit must be positive" );
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+
+  // 欠费索引在action结束时才更新，遍历期间索引不变
+  delinquency_table delinquencies( get_self(), get_self().value );
+  auto idx = delinquencies.get_index<"exhausttime"_n>();
+  vector<balance_result> balances;
+  for ( auto itr = idx.begin(); itr != idx.end() && itr->exhaust_time <= tmp_t && balances.size() < limit; ++itr ) {
+    auto user = _users.require_find( itr->owner.value, "user not exists in users table." );
+    _users.modify( user, same_payer, [&]( auto &row ) {
+      settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
+    });
+    balances.push_back( balance_result{ user->owner, user->hdds } );
+  }
+  return balances;
+}
+
+// 提价后按当前价格重新计算所有用户的预计耗尽时间，从上次的位置继续，完成后删除进度
+store::settle_page store::reindexdelq( uint32_t limit, const name& caller )
+{
+  check( is_account( caller ), "caller not a account." );
+  check_admin_account( caller, 0, false );
+  check( limit > 0, "limit must be positive" );
+
+  delinq_reindex_singleton reindex( get_self(), get_self().value );
+  check( reindex.exists(), "delinquency index is up to date" );
+  auto state = reindex.get();
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t price = current_fee_price( fee_epochs );
+  uint64_t tmp_t = current_time();
+  delinquency_table delinquencies( get_self(), get_self().value );
+
+  settle_page page;
+  state.cursor = for_each_user( state.cursor, limit, [&]( uint64_t pk ) {
+    auto user = _users.find( pk );
+    set_delinquency( delinquencies, *user, price, tmp_t );
+  });
+  page.next = name( state.cursor );
+
+  if ( state.cursor == 0 ) {
+    reindex.remove();
+  } else {
+    reindex.set( state, get_self() );
+  }
+  return page;
 }
 
 // 设置存储周期费用
@@ -276,18 +665,19 @@ void store::sethfee( const name& user, int64_t fee, const name& caller )
   check( fee >= 0, "must use positive fee value" );
 
 
-  users_table users( get_self(), get_self().value );
-  auto _user = users.require_find( user.value, "the user is not create" );
+  auto _user = _users.require_find( user.value, "the user is not create" );
   check( fee != _user->hdds_per_cycle_fee, " the fee is the same");
 
   check_admin_account( caller, user.value, true );
 
   check( is_hdd_amount_within_range( fee ), "magnitude of fee must be less than 2^62" );      
 
-  // 更新hdds余额
-  update_hdd_balance( users, user, true );
-
-  users.modify( _user, same_payer, [&]( auto &row ) {
+  // 按原周期费用结算hdds余额后再修改
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+  _users.modify( _user, same_payer, [&]( auto &row ) {
+    settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
     row.hdds_per_cycle_fee = fee;
   });
 }
@@ -307,12 +697,11 @@ void store::subbalance( const name& user, int64_t balance, uint8_t acc_type, con
   check( is_hdd_amount_within_range( balance ), "magnitude of hddbalance must be less than 2^62" );  
   check( balance >= 0, "must use positive balance value" );
 
-  users_table users( get_self(), get_self().value );
-  auto _user = users.require_find( user.value, "user not exists in users table" );
+  auto _user = _users.require_find( user.value, "user not exists in users table" );
 
   check_admin_account( caller, user.value, true );
 
-  users.modify( _user, same_payer, [&]( auto &row ) {
+  _users.modify( _user, same_payer, [&]( auto &row ) {
     row.hdds -= balance;
     check( is_hdd_amount_within_range( row.hdds ), "magnitude of user hdds must be less than 2^62" );
   });
@@ -324,14 +713,22 @@ void store::addhspace( const name& user, uint64_t space, const name& caller )
   check( is_account( user ), "user invalidate" );
   check( is_account( caller ), "caller not an account." );
 
-  users_table users( get_self(), get_self().value );
-  auto _user = users.require_find( user.value, "user not exists in users table" );
+  auto _user = _users.require_find( user.value, "user not exists in users table" );
 
   check_admin_account( caller, user.value, true );
 
-  users.modify( _user, same_payer, [&]( auto &row ) {
+  // 按原占用空间结算后再修改，开启按空间计费时同时更新周期费用
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+  uint64_t unit_fee = get_sysopts().hdds_unit_fee;
+  _users.modify( _user, same_payer, [&]( auto &row ) {
+    settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
     row.used_space += space;
     check( row.used_space <= max_user_space, "overflow max_userspace" );
+    if ( unit_fee > 0 ) {
+      row.hdds_per_cycle_fee = calc_hdds_per_cycle_fee( row.used_space, unit_fee );
+    }
   });
 }
 
@@ -341,15 +738,108 @@ void store::subhspace( const name& user, uint64_t space, const name& caller )
   check( is_account( user ), "user invalidate" );
   check( is_account( caller ), "caller not an account." );
 
-  users_table users( get_self(), get_self().value );
-  auto _user = users.require_find( user.value, "user not exists in users table" );
+  auto _user = _users.require_find( user.value, "user not exists in users table" );
 
   check_admin_account( caller, user.value, true );
 
-  users.modify( _user, same_payer, [&]( auto &row ) {
+  // 按原占用空间结算后再修改，开启按空间计费时同时更新周期费用
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+  uint64_t unit_fee = get_sysopts().hdds_unit_fee;
+  _users.modify( _user, same_payer, [&]( auto &row ) {
+    settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
     check(row.used_space >= space , "overdraw user hdd_space");
     row.used_space -= space;
+    if ( unit_fee > 0 ) {
+      row.hdds_per_cycle_fee = calc_hdds_per_cycle_fee( row.used_space, unit_fee );
+    }
+  });
+}
+
+// 批量修改用户占用空间，按用户排序合并后每个用户只结算和写入一次
+void store::batchhspace( const vector<space_delta>& entries, const name& caller )
+{
+  check( is_account( caller ), "caller not an account." );
+  check_admin_account( caller, 0, false );
+  check( !entries.empty(), "entries is empty" );
+
+  vector<space_delta> sorted( entries );
+  std::sort( sorted.begin(), sorted.end(), []( const space_delta& a, const space_delta& b ) {
+    return a.user < b.user;
   });
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+  uint64_t unit_fee = get_sysopts().hdds_unit_fee;
+
+  size_t i = 0;
+  while ( i < sorted.size() ) {
+    const name& user = sorted[i].user;
+
+    // 合并同一用户的修改，上下限检查针对合并后的结果
+    int128_t delta = 0;
+    for ( ; i < sorted.size() && sorted[i].user == user; i++ ) {
+      delta += sorted[i].delta;
+    }
+    if ( delta == 0 ) {
+      continue;
+    }
+
+    auto _user = _users.require_find( user.value, "user not exists in users table" );
+    _users.modify( _user, same_payer, [&]( auto &row ) {
+      settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
+      int128_t used_space = int128_t(row.used_space) + delta;
+      check( used_space >= 0, "overdraw user hdd_space" );
+      check( used_space <= max_user_space, "overflow max_userspace" );
+      row.used_space = uint64_t(used_space);
+      if ( unit_fee > 0 ) {
+        row.hdds_per_cycle_fee = calc_hdds_per_cycle_fee( row.used_space, unit_fee );
+      }
+    });
+  }
+}
+
+// 将旧版用户表中的行改写为压缩格式，升级合约后分批执行直到迁移完成，迁移期间两种格式都可以读写
+void store::migrateusers( uint64_t limit )
+{
+  require_auth( get_self() );
+  check( limit > 0, "limit must be positive" );
+
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+
+  // 已迁移的行从旧表中删除，旧表的第一行就是迁移游标
+  auto& users = _users.legacy_table();
+  auto& users_v2 = _users.table();
+  auto itr = users.begin();
+  uint64_t count = 0;
+  int64_t hddm_delta = 0;
+  while ( itr != users.end() && count < limit ) {
+    user row = *itr;
+    // 没有快照的旧数据先结算一次，直接读写数据表不经过 _users，结算的变化在这里计入全网统计
+    if ( !row.hddm_acc_snapshot.has_value() ) {
+      int64_t hddm_before = row.hddm;
+      settle_user_hddm( row, acc_now, tmp_t );
+      if ( netstats_counted( netstats_stage::users, row.primary_key() ) ) {
+        hddm_delta += row.hddm - hddm_before;
+      }
+    }
+
+    users_v2.emplace( get_self(), [&]( auto& v2 ) {
+      v2 = user_v2( row );
+    });
+
+    itr = users.erase( itr );
+    count++;
+  }
+
+  if ( hddm_delta != 0 ) {
+    _netstats.modify().hddm += hddm_delta;
+  }
+
+  print( "{\"migrated\":", count, ",\"done\":", itr == users.end() ? "true" : "false", "}" );
 }
 
 
@@ -369,30 +859,91 @@ void store::newminer( uint64_t minerid, const name& adminacc, const name& dep_ac
   check( is_account( dep_acc ), "dep_acc invalidate" );
   check( dep_amount.amount > 0, "must use positive dep_amount" );
 
-  miners_table miners( get_self(), get_self().value );
-  auto existing = miners.find( minerid );
-  check(existing == miners.end(), "miner already registered");
+  auto existing = _miners.find( minerid );
+  check(existing == _miners.end(), "miner already registered");
+
+  // 未迁移的旧矿机同样视为已注册
+  miners_v1_table miners_v1( get_self(), get_self().value );
+  check( miners_v1.find( minerid ) == miners_v1.end(), "miner already registered" );
 
-  miners.emplace( dep_acc, [&]( auto &row ) {      
+  _miners.emplace( dep_acc, [&]( auto &row ) {      
     row.id             = minerid;
     row.admin          = adminacc;
     row.depacc         = dep_acc;
   });
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
-  sinfo.miner_count += 1;
-  sys_info.set( sinfo, get_self() );
+  uint64_t tmp_t = current_time();
+  _miner_stats.emplace( dep_acc, [&]( auto &row ) {
+    row.id                    = minerid;
+    row.hddm_last_update_time = tmp_t;
+    row.hddm_acc_snapshot     = current_hddm_acc( tmp_t );
+  });
+
+  auto& counter = _syscounter.modify();
+  counter.miner_count += 1;
 
   // 支付押金 另一个合约方法
   chgdeposit( dep_acc, minerid, true, dep_amount );
 }
 
+// 批量添加矿机，押金总额只检查和扣除一次
+void store::newminers( const name& dep_acc, const vector<new_miner>& miners )
+{
+  require_auth( dep_acc ); // 抵押账号签名
+
+  check( is_account( dep_acc ), "dep_acc invalidate" );
+  check( !miners.empty(), "miners is empty" );
+
+  bool is_frozen = token::is_frozen( TOKEN_ACCOUNT, dep_acc );
+  check( !is_frozen, "miner's depacc is frozen" );
+
+  auto deposit = _deposits.require_find( dep_acc.value, "no deposit record for this minerid." );
+
+  miners_v1_table miners_v1( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+
+  asset dep_sum( 0, CORE_SYMBOL );
+  for ( const auto& m : miners ) {
+    check( is_account( m.adminacc ), "adminacc invalidate" );
+    check( m.dep_amount.symbol == CORE_SYMBOL, "must use core asset for hdd deposit." );
+    check( m.dep_amount.amount > 0, "must use positive dep_amount" );
+
+    auto existing = _miners.find( m.minerid );
+    check( existing == _miners.end(), "miner already registered" );
+    check( miners_v1.find( m.minerid ) == miners_v1.end(), "miner already registered" );
+
+    _miners.emplace( dep_acc, [&]( auto &row ) {
+      row.id        = m.minerid;
+      row.admin     = m.adminacc;
+      row.depacc    = dep_acc;
+      row.deposit   = m.dep_amount;
+      row.dep_total = m.dep_amount;
+    });
+
+    _miner_stats.emplace( dep_acc, [&]( auto &row ) {
+      row.id                    = m.minerid;
+      row.hddm_last_update_time = tmp_t;
+      row.hddm_acc_snapshot     = acc_now;
+    });
+
+    dep_sum += m.dep_amount;
+  }
+
+  check( deposit->deposit_total.amount - deposit->deposit_used.amount >= dep_sum.amount, "free deposit not enough." );
+  _deposits.modify( deposit, same_payer, [&]( auto& row ) {
+    row.deposit_used += dep_sum;
+  });
+
+  auto& counter = _syscounter.modify();
+  counter.miner_count += miners.size();
+}
+
 // 删除矿机
 void store::delminer( uint64_t minerid, uint8_t acc_type, const name& caller )
 {
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not exist in miners table" );
+  auto miner = require_find_miner( minerid, "minerid not exist in miners table" );
+  auto stat = _miner_stats.require_find( minerid, "minerid not exist in minerstats table" );
 
   if( acc_type == 1 ) {
     check( is_account( caller ), "caller not a account." );
@@ -406,10 +957,9 @@ void store::delminer( uint64_t minerid, uint8_t acc_type, const name& caller )
   }
 
   // 如果抵押过了，返还抵押部分
-  deposits_table deposits( get_self(), get_self().value );
-  auto depacc = deposits.find( miner->depacc.value );
-  if( depacc != deposits.end() ) {
-    deposits.modify( depacc, same_payer, [&]( auto& row ) {
+  auto depacc = _deposits.find( miner->depacc.value );
+  if( depacc != _deposits.end() ) {
+    _deposits.modify( depacc, same_payer, [&]( auto& row ) {
       row.deposit_used -= miner->deposit;
       if( row.deposit_used.amount <= 0 ) {
         row.deposit_used = asset(0, CORE_SYMBOL);
@@ -417,38 +967,36 @@ void store::delminer( uint64_t minerid, uint8_t acc_type, const name& caller )
     });    
   }
 
-  //扣除该矿机的收益账号的周期收益
-  if( miner->owner.value != 0 ) {
-    users_table users( get_self(), get_self().value );
-    auto user = users.find( miner->owner.value );
-    if( user != users.end() ) {
-      update_hdd_balance( users, miner->owner, false );
-      update_miner_hddm_balance( miners, minerid );
-      users.modify( user, same_payer, [&]( auto& row ) {
-        row.prod_space -= miner->prod_space;
-        row.hddm_per_cycle_profit -= miner->hddm_per_cycle_profit;
+  //扣除该矿机的收益账号的周期收益，不活跃的矿机已经扣除过
+  if( miner->owner.value != 0 && stat->hddm_per_cycle_profit > 0 ) {
+    auto user = _users.find( miner->owner.value );
+    if( user != _users.end() ) {
+      uint64_t tmp_t = current_time();
+      uint64_t acc_now = current_hddm_acc( tmp_t );
+      uint64_t profit_per_space = current_profit_per_space();
+      _users.modify( user, same_payer, [&]( auto& row ) {
+        settle_user_hddm( row, acc_now, tmp_t );
+        update_owner_space( row, stat->prod_space, 0, profit_per_space );
       });
     }
   }
 
   //归还空间到storepool
   if( miner->pool_id.value != 0 ) {
-    store_pools_table store_pools( get_self(), get_self().value );
-    auto store_pool = store_pools.find( miner->pool_id.value );
-    if( store_pool != store_pools.end() ) {
-      store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
+    auto store_pool = _store_pools.find( miner->pool_id.value );
+    if( store_pool != _store_pools.end() ) {
+      _store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
         row.prod_space -= miner->max_space;
       });  
     }
   }
 
   //删除该矿机信息
-  miners.erase( miner );
+  _miners.erase( miner );
+  _miner_stats.erase( stat );
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
-  sinfo.miner_count -= 1;
-  sys_info.set( sinfo, get_self() );
+  auto& counter = _syscounter.modify();
+  counter.miner_count -= 1;
 }
 
 // 存储网抵押
@@ -465,13 +1013,12 @@ void store::paydeppool( const name& user, asset quant )
 
   //check if user has enough YTA balance for deposit
   auto balance   = token::get_balance( TOKEN_ACCOUNT, user, CORE_SYMBOL.code() );
-  deposits_table deposits( get_self(), get_self().value ); // 实例化抵押表
-  auto deposit = deposits.find( user.value );
+  auto deposit = _deposits.find( user.value );
   
   //插入或者更新抵押表
-  if ( deposit == deposits.end() ) {
+  if ( deposit == _deposits.end() ) {
     check( balance.amount >= quant.amount, "user balance not enough." );
-    deposits.emplace( user, [&]( auto& row ){
+    _deposits.emplace( user, [&]( auto& row ){
       row.owner = user;
       row.deposit_total = quant;
       row.deposit_his = quant;
@@ -479,7 +1026,7 @@ void store::paydeppool( const name& user, asset quant )
   } else {
     asset deposit_total = deposit->deposit_total + quant;
     check( balance.amount >= deposit_total.amount, "user balance not enough." );
-    deposits.modify( deposit, same_payer, [&]( auto& row ) {
+    _deposits.modify( deposit, same_payer, [&]( auto& row ) {
       row.deposit_total += quant;
       row.deposit_his += quant;
     });
@@ -498,15 +1045,14 @@ void store::unpaydeppool( const name& user, asset quant )
   bool is_frozen = token::is_frozen( TOKEN_ACCOUNT, user );
   check( !is_frozen, "user is frozen" );
 
-  deposits_table deposits( get_self(), get_self().value );
-  auto deposit = deposits.require_find( user.value, "no deposit record for this user." );
+  auto deposit = _deposits.require_find( user.value, "no deposit record for this user." );
 
   check( deposit->deposit_total.amount - deposit->deposit_used.amount >= quant.amount, "free deposit not enough." );
   check( deposit->deposit_total.amount >= quant.amount, "deposit not enough." );
   check( deposit->deposit_his.amount >= quant.amount, "deposit not enough." );
 
   // 修改抵押表
-  deposits.modify( deposit, same_payer, [&]( auto& row ) {
+  _deposits.modify( deposit, same_payer, [&]( auto& row ) {
     row.deposit_total -= quant;
     row.deposit_his -= quant;
   });
@@ -517,11 +1063,9 @@ void store::addm2pool( uint64_t minerid, const name& pool_id, const name& minero
 {
   check( is_account( minerowner ), "minerowner invalidate" );
 
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
 
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool = store_pools.require_find( pool_id.value, "storepool not registered" );
+  auto store_pool = _store_pools.require_find( pool_id.value, "storepool not registered" );
 
   require_auth( miner->admin );
   require_auth( store_pool->owner );
@@ -535,23 +1079,29 @@ void store::addm2pool( uint64_t minerid, const name& pool_id, const name& minero
   check( is_deposit_enough( miner->deposit, max_space ), "deposit not enough for miner's max_space -- addm2pool" );
   //--- check miner deposit and max_space
 
+  // 结算矿机收益
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  auto stat = _miner_stats.require_find( minerid, "minerid not register" );
+  _miner_stats.modify( stat, same_payer, [&]( auto &row ) {
+    settle_miner_hddm( row, acc_now, tmp_t );
+  });
+
   // 修改矿机信息的矿池字段
-  miners.modify( miner, same_payer, [&]( auto &row ) {
+  _miners.modify( miner, same_payer, [&]( auto &row ) {
     row.pool_id = pool_id;
     row.owner = minerowner;
     row.max_space = max_space;
-    row.hddm_last_update_time = current_time();
   });  
 
   // 扣除矿池配额
-  store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
+  _store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
     row.prod_space += max_space;
   });
 
   // 如果收益账户为开户则开户
-  users_table users( get_self(), get_self().value );
-  auto existing = users.find( minerowner.value );
-  if ( existing == users.end() ) {
+  auto existing = _users.find( minerowner.value );
+  if ( existing == _users.end() ) {
     create_user( minerowner, miner->admin );
   }
 }
@@ -560,13 +1110,11 @@ void store::addm2pool( uint64_t minerid, const name& pool_id, const name& minero
 // 矿机修改所属矿池
 void store::mchgstrpool( uint64_t minerid, const name& new_poolid )
 {
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
 
   // 归还旧矿池空间
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool_old = store_pools.require_find( miner->pool_id.value, "original storepool not registered" );
-  store_pools.modify( store_pool_old, same_payer, [&]( auto &row ) {
+  auto store_pool_old = _store_pools.require_find( miner->pool_id.value, "original storepool not registered" );
+  _store_pools.modify( store_pool_old, same_payer, [&]( auto &row ) {
     check(row.prod_space >= miner->max_space, "over space");
     row.prod_space -= miner->max_space;
     // if(row.prod_space <= 0) {
@@ -575,7 +1123,7 @@ void store::mchgstrpool( uint64_t minerid, const name& new_poolid )
   }); 
 
   //清空miner表中该矿机的矿池id
-  miners.modify( miner, same_payer, [&]( auto &row ) {
+  _miners.modify( miner, same_payer, [&]( auto &row ) {
     row.pool_id.value = 0;
   });
 
@@ -584,14 +1132,11 @@ void store::mchgstrpool( uint64_t minerid, const name& new_poolid )
 }
 
 // 更新hddm收益
-void store::calcprofit( const name& user )
+store::balance_result store::calcprofit( const name& user )
 {
   require_auth( user );
 
-  users_table users( get_self(), get_self().value );
-  auto _user = users.require_find( user.value, "user not exists in users table" );
-
-  update_hdd_balance( users, user, false );
+  return balance_result{ user, update_hdd_balance( user, false ) };
 }
 
 // 用户出售hdd
@@ -604,23 +1149,21 @@ void store::sellhdd( const name& user, int64_t amount, const string& memo )
   check( is_hdd_amount_within_range( amount ), "magnitude of user hdd amount must be less than 2^62" );      
 
 
-  users_table users( get_self(), get_self().value );
-  auto _user = users.require_find( user.value, "user not exists in users table" );
+  auto _user = _users.require_find( user.value, "user not exists in users table" );
   check( _user->hddm >= amount, "hdd overdrawn." );
 
-  users.modify( _user, same_payer, [&]( auto &row ) {
+  _users.modify( _user, same_payer, [&]( auto &row ) {
     row.hddm -= amount;
     check( is_hdd_amount_within_range( row.hddm ), "magnitude of user hddm must be less than 2^62" );      
   });
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
+  const auto& sinfo = _sysinfo.get();
 
-  int64_t _token_amount =(int64_t)( ( (double)amount/10000) * ((double)sinfo.hdd_price/(double)sinfo.token_price) * ((double)sinfo.dup_remove_ratio/10000) * ((double)sinfo.dup_remove_dist_ratio/10000) );
+  int64_t _token_amount = calc_sell_token_amount( amount, sinfo );
 
   // 给用户转相应的token
   asset quant{ _token_amount, CORE_SYMBOL };
-  systransfer( HDD_ACCOUNT, user, quant, "sell hddm" );
+  pay_from_hdd_account( user, quant, "sell hddm" );
 }
 
 // 采购矿机空间 owner 参数多余？
@@ -630,104 +1173,251 @@ void store::addmprofit( const name& owner, uint64_t minerid, uint64_t space, con
   check( is_account( caller ), "caller not an account." );
   check_admin_account( caller, minerid, true );
 
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
-  check( space + miner->prod_space <= miner->max_space, "exceed max space" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
+  auto stat = _miner_stats.require_find( minerid, "minerid not register" );
+  check( space + stat->prod_space <= miner->max_space, "exceed max space" );
   check( miner->owner == owner, "invalid owner");
 
-  miners.modify( miner, same_payer, [&]( auto &row ) {
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  uint64_t profit_per_space = current_profit_per_space();
+
+  // 不活跃的矿机增加空间后仍然不活跃，收益账号只计入活跃矿机的生产空间
+  uint64_t counted_before = billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
+  _miner_stats.modify( stat, same_payer, [&]( auto &row ) {
+    settle_miner_hddm( row, acc_now, tmp_t );
+    row.hddm_per_cycle_profit = billing::calc_miner_profit_after_add( row.prod_space, row.hddm_per_cycle_profit, space, profit_per_space );
     row.prod_space += space;
-    row.hddm_per_cycle_profit = (int64_t)((double)(row.prod_space / (double)one_gb) * ((double)fee_cycle / (double)milliseconds_in_one_year) * 100000000);
   });
+  uint64_t counted_after = billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
   
-  users_table users( get_self(), get_self().value );
-  auto user = users.require_find( miner->owner.value, "owner not exists in users table." );
+  auto user = _users.require_find( miner->owner.value, "owner not exists in users table." );
 
-  // 更新hddm余额
-  update_hdd_balance( users, miner->owner, false );
-
-  users.modify( user, same_payer, [&]( auto &row ) {
-    row.prod_space += space;
-    //每周期收益 += (生产空间/1GB）*（记账周期/ 1年）
-    row.hddm_per_cycle_profit = (int64_t)((double)(row.prod_space / (double)one_gb) * ((double)fee_cycle / (double)milliseconds_in_one_year) * 100000000);
+  // 结算hddm余额并更新生产空间
+  _users.modify( user, same_payer, [&]( auto &row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    //每周期收益 = (生产空间/1GB）*（记账周期/ 1年）
+    update_owner_space( row, counted_before, counted_after, profit_per_space );
   });
 }
 
-// 矿机更新hddm累计收益
-void store::calcmbalance( const name& owner, uint64_t minerid )
+// 批量采购矿机空间，按收益账号汇总后每个账号只结算和修改一次
+void store::addmprofits( const vector<miner_space>& entries, const name& caller )
 {
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  check( is_account( caller ), "caller not an account." );
+  check_admin_account( caller, 0, false );
+  check( !entries.empty(), "entries is empty" );
+
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  uint64_t profit_per_space = current_profit_per_space();
+
+  // 收益账号 => 修改前后计入的生产空间，不活跃的矿机增加空间后仍然不活跃，不计入
+  std::map<uint64_t, std::pair<uint64_t, uint64_t>> owner_spaces;
+  for ( const auto& entry : entries ) {
+    auto miner = require_find_miner( entry.minerid, "minerid not register" );
+    auto stat = _miner_stats.require_find( entry.minerid, "minerid not register" );
+    check( miner->owner.value != 0, "no owner for this miner" );
+    check( entry.space + stat->prod_space <= miner->max_space, "exceed max space" );
+
+    uint64_t counted_before = billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
+    _miner_stats.modify( stat, same_payer, [&]( auto &row ) {
+      settle_miner_hddm( row, acc_now, tmp_t );
+      row.hddm_per_cycle_profit = billing::calc_miner_profit_after_add( row.prod_space, row.hddm_per_cycle_profit, entry.space, profit_per_space );
+      row.prod_space += entry.space;
+    });
+    uint64_t counted_after = billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
 
-  require_auth( miner->owner );
+    auto& spaces = owner_spaces[miner->owner.value];
+    spaces.first += counted_before;
+    spaces.second += counted_after;
+  }
 
-  miners.modify( miner, get_self(), [&]( auto &row ) {
-    uint64_t tmp_t = current_time();
-    row.total_profit = calculate_balance( miner->total_profit , 0, miner->hddm_per_cycle_profit, miner->hddm_last_update_time, tmp_t);
-    row.hddm_last_update_time = tmp_t;
-  });
+  // 结算hddm余额并更新生产空间
+  for ( const auto& [owner, spaces] : owner_spaces ) {
+    auto user = _users.require_find( owner, "owner not exists in users table." );
+    _users.modify( user, same_payer, [&]( auto &row ) {
+      settle_user_hddm( row, acc_now, tmp_t );
+      update_owner_space( row, spaces.first, spaces.second, profit_per_space );
+    });
+  }
 }
 
-// 矿机状态更改为不活跃，无收益 owner多余
-void store::mdeactive( const name& owner, uint64_t minerid, const name& caller )
+// 矿机更新hddm累计收益
+void store::calcmbalance( const name& owner, uint64_t minerid )
 {
-  (void(owner));
-  // check( is_account( owner ), "owner invalidate" );
-  check( is_account( caller ), "caller not an account." );
+  raw_row miner( get_self(), get_self().value, "minerinfo"_n, minerid );
+  if ( !miner.exists() ) {
+    // 旧版矿机迁移时已经结算
+    auto legacy = require_find_miner( minerid, "minerid not register" );
+    require_auth( legacy->owner );
+    return;
+  }
 
-  check_admin_account( caller, minerid, true );
+  require_auth( name( miner.get<uint64_t>( miner_offset::owner ) ) );
 
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
-  check( miner->hddm_per_cycle_profit > 0 && miner->prod_space > 0, "Can't deactive a not active miner" );
+  raw_row stat( get_self(), get_self().value, "minerstats"_n, minerid );
+  check( stat.exists(), "minerid not register" );
 
-  // 更新收益账号hddm余额,减少周期收益
-  users_table users( get_self(), get_self().value );
-  auto user = users.require_find( miner->owner.value, "the miner's owner is not exist" );
-  update_hdd_balance( users, miner->owner, false );
-  users.modify( user, same_payer, [&]( auto& row ) {
-    row.hddm_per_cycle_profit -= miner->hddm_per_cycle_profit;
-    row.prod_space -= miner->prod_space;
-  });
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
 
-  // 更新矿机收益，周期收益设为0
-  update_miner_hddm_balance( miners, minerid );
-  miners.modify( miner, same_payer, [&]( auto &row ) {
-    row.hddm_per_cycle_profit = 0;
-  });
+  if ( stat.get<uint64_t>( miner_stat_offset::hddm_per_cycle_profit ) > 0 ) {
+    uint128_t delta = accrued_hddm( stat.get<uint64_t>( miner_stat_offset::prod_space ), acc_now, stat.get<uint64_t>( miner_stat_offset::hddm_acc_snapshot ) );
+    stat.set( miner_stat_offset::total_profit, fixmath::to_uint64( delta + stat.get<uint64_t>( miner_stat_offset::total_profit ) ) );
+  }
+  stat.set( miner_stat_offset::hddm_acc_snapshot, acc_now );
+  stat.set( miner_stat_offset::hddm_last_update_time, tmp_t );
+  stat.store( get_self() );
 }
 
-// 矿机状态更改为活跃矿机，有收益 如何区分矿机是否活跃？？？
-void store::mactive( const name& owner, uint64_t minerid, const name& caller )
+// 将旧版矿机表中的行拆分写入 minerinfo 和 minerstats，升级合约后分批执行直到迁移完成
+void store::migminers( uint64_t limit )
 {
-  (void(owner));
-  // check( is_account( owner ), "owner not an account." );
-  check( is_account( caller ), "caller not an account." );
-
-  check_admin_account( caller, minerid, true );
+  require_auth( get_self() );
+  check( limit > 0, "limit must be positive" );
 
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
-  check( miner->hddm_per_cycle_profit == 0 && miner->prod_space > 0, "Can't active an active miner" );
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+
+  miners_v1_table miners_v1( get_self(), get_self().value );
+  auto itr = miners_v1.begin();
+  uint64_t count = 0;
+  while ( itr != miners_v1.end() && count < limit ) {
+    itr = migrate_miner( miners_v1, itr, acc_now, tmp_t );
+    count++;
+  }
+
+  print( "{\"migrated\":", count, ",\"done\":", itr == miners_v1.end() ? "true" : "false", "}" );
+}
+
+// 将一台旧版矿机拆分写入 minerinfo 和 minerstats 并从旧表删除，返回旧表中的下一行
+store::miners_v1_table::const_iterator store::migrate_miner( miners_v1_table& miners_v1, miners_v1_table::const_iterator itr, uint64_t acc_now, uint64_t now )
+{
+  _miners.emplace( get_self(), [&]( auto &row ) {
+    row.id        = itr->id;
+    row.owner     = itr->owner;
+    row.admin     = itr->admin;
+    row.pool_id   = itr->pool_id;
+    row.depacc    = itr->depacc;
+    row.deposit   = itr->deposit;
+    row.dep_total = itr->dep_total;
+    row.max_space = itr->max_space;
+  });
+
+  // 迁移时结算一次，之后全部按累计收益结算
+  _miner_stats.emplace( get_self(), [&]( auto &row ) {
+    row.id                    = itr->id;
+    row.prod_space            = itr->prod_space;
+    row.hddm_per_cycle_profit = itr->hddm_per_cycle_profit;
+    row.total_profit          = itr->total_profit;
+    if ( itr->hddm_acc_snapshot.has_value() ) {
+      row.hddm_acc_snapshot = itr->hddm_acc_snapshot.value();
+      settle_miner_hddm( row, acc_now, now );
+    } else {
+      row.total_profit          = calculate_balance( itr->total_profit, 0, itr->hddm_per_cycle_profit, itr->hddm_last_update_time, now );
+      row.hddm_acc_snapshot     = acc_now;
+      row.hddm_last_update_time = now;
+    }
+  });
+
+  return miners_v1.erase( itr );
+}
+
+// 读取矿机，还在旧版矿机表中时先迁移
+const store::miner* store::find_miner( uint64_t minerid )
+{
+  auto miner = _miners.find( minerid );
+  if ( miner != _miners.end() ) {
+    return miner;
+  }
+
+  miners_v1_table miners_v1( get_self(), get_self().value );
+  auto itr = miners_v1.find( minerid );
+  if ( itr == miners_v1.end() ) {
+    return _miners.end();
+  }
+  uint64_t tmp_t = current_time();
+  migrate_miner( miners_v1, itr, current_hddm_acc( tmp_t ), tmp_t );
+  return _miners.find( minerid );
+}
+
+const store::miner* store::require_find_miner( uint64_t minerid, const char* error_msg )
+{
+  auto miner = find_miner( minerid );
+  check( miner != _miners.end(), error_msg );
+  return miner;
+}
+
+// 按索引遍历矿机的分页操作只能看到 minerinfo，旧版矿机表迁移完成前不能执行
+void store::check_miners_migrated()
+{
+  miners_v1_table miners_v1( get_self(), get_self().value );
+  check( miners_v1.begin() == miners_v1.end(), "miners not fully migrated, run migminers first" );
+}
+
+// 矿机状态更改为不活跃，无收益 owner多余
+void store::mdeactive( const name& owner, uint64_t minerid, const name& caller )
+{
+  (void(owner));
+  // check( is_account( owner ), "owner invalidate" );
+  check( is_account( caller ), "caller not an account." );
+
+  check_admin_account( caller, minerid, true );
+
+  auto miner = require_find_miner( minerid, "minerid not register" );
+  auto stat = _miner_stats.require_find( minerid, "minerid not register" );
+  check( stat->hddm_per_cycle_profit > 0 && stat->prod_space > 0, "Can't deactive a not active miner" );
+
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+
+  // 更新收益账号hddm余额,减少周期收益
+  uint64_t profit_per_space = current_profit_per_space();
+  auto user = _users.require_find( miner->owner.value, "the miner's owner is not exist" );
+  _users.modify( user, same_payer, [&]( auto& row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    update_owner_space( row, stat->prod_space, 0, profit_per_space );
+  });
+
+  // 更新矿机收益，周期收益设为0
+  _miner_stats.modify( stat, same_payer, [&]( auto &row ) {
+    settle_miner_hddm( row, acc_now, tmp_t );
+    row.hddm_per_cycle_profit = 0;
+  });
+}
+
+// 矿机状态更改为活跃矿机，有收益 如何区分矿机是否活跃？？？
+void store::mactive( const name& owner, uint64_t minerid, const name& caller )
+{
+  (void(owner));
+  // check( is_account( owner ), "owner not an account." );
+  check( is_account( caller ), "caller not an account." );
+
+  check_admin_account( caller, minerid, true );
+
+  auto miner = require_find_miner( minerid, "minerid not register" );
+  auto stat = _miner_stats.require_find( minerid, "minerid not register" );
+  check( stat->hddm_per_cycle_profit == 0 && stat->prod_space > 0, "Can't active an active miner" );
 
-  // update_miner_hddm_balance( miners, minerid );
-  
-  int64_t profit = 0;
   //每周期收益 += (生产空间*数据分片大小/1GB）*（记账周期/ 1年）
-  profit = (int64_t)(((double)miner->prod_space / (double)one_gb) * ((double)fee_cycle / (double)milliseconds_in_one_year) * 100000000);
+  uint64_t profit_per_space = current_profit_per_space();
+  int64_t profit = calc_hddm_per_cycle_profit( stat->prod_space, profit_per_space );
+
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
 
-  miners.modify( miner, same_payer , [&]( auto &row ) {
-    row.hddm_last_update_time = current_time();
+  // 不活跃的矿机没有收益，结算只更新快照
+  _miner_stats.modify( stat, same_payer , [&]( auto &row ) {
+    settle_miner_hddm( row, acc_now, tmp_t );
     row.hddm_per_cycle_profit = profit;
   });
 
-  // 更新用户表，周期收益
-  users_table users( get_self(), get_self().value );
-  auto user = users.find( miner->owner.value );
-  update_hdd_balance( users, miner->owner, false );
-  users.modify( user, same_payer, [&]( auto& row ) {
-    row.hddm_per_cycle_profit += miner->hddm_per_cycle_profit;
-    row.prod_space += miner->prod_space;
+  // 更新用户表，周期收益，收益率为0时矿机仍然不活跃，不计入
+  auto user = _users.require_find( miner->owner.value, "the miner's owner is not exist" );
+  _users.modify( user, same_payer, [&]( auto& row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    update_owner_space( row, 0, billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit ), profit_per_space );
   });
 }
 
@@ -736,12 +1426,11 @@ void store::mchgadminacc( uint64_t minerid, const name& new_adminacc )
 {
   check( is_account( new_adminacc ), "new admin is not an account.");
 
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
 
   require_auth( miner->admin );
 
-  miners.modify( miner, same_payer, [&]( auto &row ) {
+  _miners.modify( miner, same_payer, [&]( auto &row ) {
     row.admin = new_adminacc;
   });
 }
@@ -749,8 +1438,7 @@ void store::mchgadminacc( uint64_t minerid, const name& new_adminacc )
 // 矿机修改收益账号
 void store::mchgowneracc( uint64_t minerid, const name& new_owneracc )
 {
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
 
   check( is_account( new_owneracc ), "new owner is not an account.");
   check( miner->owner.value != 0, "no owner for this miner" );
@@ -761,63 +1449,121 @@ void store::mchgowneracc( uint64_t minerid, const name& new_owneracc )
   require_auth( miner->admin );
   require_auth( pool_owner );
 
+  auto stat = _miner_stats.require_find( minerid, "minerid not register" );
+  uint64_t counted = billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
+
   uint64_t tmp_t = current_time();
-  users_table users( get_self(), get_self().value );
-
-  // 结算旧owner账户当前的收益，并扣除当前矿机的周期收益生产空间
-  auto owner_old = users.require_find( miner->owner.value, "the old owner is not exist" );
-  update_hdd_balance( users, miner->owner, false );
-  users.modify( owner_old, same_payer, [&]( auto& row ) {
-    row.hddm_per_cycle_profit -= miner->hddm_per_cycle_profit;
-    row.prod_space -= miner->prod_space;
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  uint64_t profit_per_space = current_profit_per_space();
+
+  // 结算旧owner账户当前的收益，并扣除当前矿机的周期收益生产空间，不活跃的矿机不计入
+  auto owner_old = _users.require_find( miner->owner.value, "the old owner is not exist" );
+  _users.modify( owner_old, same_payer, [&]( auto& row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    update_owner_space( row, counted, 0, profit_per_space );
   });
 
   // 结算新owner账户当前的收益，并增加当前矿机的周期收益生产空间
-  auto user_new = users.find( new_owneracc.value );
-  if ( user_new == users.end() ) {
+  auto user_new = _users.find( new_owneracc.value );
+  if ( user_new == _users.end() ) {
     create_user( new_owneracc, miner->admin );
-    user_new = users.find( new_owneracc.value );
-  } else {
-    update_hdd_balance( users, new_owneracc, false );
+    user_new = _users.find( new_owneracc.value );
   }
-  users.modify( user_new, same_payer, [&]( auto& row ) {
-    row.hddm_per_cycle_profit += miner->hddm_per_cycle_profit;
-    row.prod_space += miner->prod_space;
+  _users.modify( user_new, same_payer, [&]( auto& row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    update_owner_space( row, 0, counted, profit_per_space );
   });
 
   //变更矿机表的收益账户名称
-  miners.modify( miner, get_self(), [&]( auto &row ) {
+  _miners.modify( miner, get_self(), [&]( auto &row ) {
     row.owner = new_owneracc;
   });
 }
 
+// 按 owner 索引批量变更矿机的收益账号，变更后的矿机离开原账号的索引区间，索引区间的起点就是下一次处理的位置
+// 两个收益账号每次只结算一次，活跃矿机的生产空间汇总后一次转移，不活跃的矿机不计入收益账号
+void store::mchgownerall( const name& old_owner, const name& new_owner, uint32_t limit )
+{
+  check( is_account( new_owner ), "new owner is not an account.");
+  check( old_owner != new_owner, "new owner already own this miner" );
+  check( limit > 0, "limit must be positive" );
+  check_miners_migrated();
+
+  // 修改在action结束时才写入，遍历期间索引不变
+  auto idx = _miners.table().get_index<"owner"_n>();
+  auto itr = idx.lower_bound( old_owner.value );
+  check( itr != idx.end() && itr->owner == old_owner, "no miner owned by old owner" );
+  name ram_payer = itr->admin;
+
+  // 每个矿机管理员和矿池所有者只验证一次
+  std::set<uint64_t> authorized;
+  uint64_t moved_space = 0;
+  uint32_t count = 0;
+  for ( ; itr != idx.end() && itr->owner == old_owner && count < limit; ++itr, ++count ) {
+    auto miner = _miners.find( itr->id );
+    for ( const name& acc : { miner->admin, get_miner_pool_owner( miner->pool_id ) } ) {
+      if ( authorized.insert( acc.value ).second ) {
+        require_auth( acc );
+      }
+    }
+
+    auto stat = _miner_stats.require_find( itr->id, "minerid not register" );
+    moved_space += billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
+
+    _miners.modify( miner, get_self(), [&]( auto &row ) {
+      row.owner = new_owner;
+    });
+  }
+
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  uint64_t profit_per_space = current_profit_per_space();
+
+  auto owner_old = _users.require_find( old_owner.value, "the old owner is not exist" );
+  _users.modify( owner_old, same_payer, [&]( auto& row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    update_owner_space( row, moved_space, 0, profit_per_space );
+  });
+
+  auto user_new = _users.find( new_owner.value );
+  if ( user_new == _users.end() ) {
+    create_user( new_owner, ram_payer );
+    user_new = _users.find( new_owner.value );
+  }
+  _users.modify( user_new, same_payer, [&]( auto& row ) {
+    settle_user_hddm( row, acc_now, tmp_t );
+    update_owner_space( row, 0, moved_space, profit_per_space );
+  });
+
+  bool done = itr == idx.end() || itr->owner != old_owner;
+  print( "{\"moved\":", count, ",\"done\":", done ? "true" : "false", "}" );
+}
+
 // 矿机修改抵押账号
 void store::mchgdepacc( uint64_t minerid, const name& new_depacc )
 {
   require_auth( new_depacc );
 
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
   check( miner->depacc != new_depacc, "must use different account to change deposit user" );
 
-  deposits_table deposits( get_self(), get_self().value );
-  auto depacc_old = deposits.require_find( miner->depacc.value, "no deposit record for original deposit user" );
-  auto depacc_new = deposits.require_find( new_depacc.value, "no deposit record for new deposit user" );
+  auto depacc_old = _deposits.require_find( miner->depacc.value, "no deposit record for original deposit user" );
+  auto depacc_new = _deposits.require_find( new_depacc.value, "no deposit record for new deposit user" );
   check( depacc_new->deposit_total.amount - depacc_new->deposit_used.amount >= miner->deposit.amount, "new deposit user free deposit not enough" );
 
   //变更原抵押账户的押金数量
-  deposits.modify( depacc_old, same_payer, [&]( auto& row ) {
+  _deposits.modify( depacc_old, same_payer, [&]( auto& row ) {
     row.deposit_used -= miner->deposit;
   });  
 
   //将矿机的押金数量重新恢复到未扣罚金的初始额度
-  miners.modify( miner, same_payer, [&]( auto& row ) {
+  _miners.modify( miner, same_payer, [&]( auto& row ) {
     row.depacc  = new_depacc;
     row.deposit = row.dep_total;
   });
 
   // 添加新账号的已使用押金
-  deposits.modify( depacc_new, same_payer, [&]( auto& row ) {
+  _deposits.modify( depacc_new, same_payer, [&]( auto& row ) {
     row.deposit_used += miner->dep_total;
   });
 }
@@ -825,8 +1571,7 @@ void store::mchgdepacc( uint64_t minerid, const name& new_depacc )
 // 矿机修改最大存储空间
 void store::mchgspace( uint64_t minerid, uint64_t max_space )
 {
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
   check( max_space <= max_miner_space, "miner max_space overflow" );  
   check( max_space >= min_miner_space, "miner max_space underflow" );
   check( max_space != miner->max_space, "can't change same space" );
@@ -850,9 +1595,8 @@ void store::mchgspace( uint64_t minerid, uint64_t max_space )
   require_auth( pool_owner );
 
   // 修改矿池信息
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool = store_pools.require_find( miner->pool_id.value, "storepool not exist" ); 
-  store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
+  auto store_pool = _store_pools.require_find( miner->pool_id.value, "storepool not exist" ); 
+  _store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
     if( is_add_space ) {
       check( row.max_space - row.prod_space >= diff_space, "exceed storepool's max space" );      
       row.prod_space += diff_space;
@@ -862,8 +1606,9 @@ void store::mchgspace( uint64_t minerid, uint64_t max_space )
   });
 
   // 修改矿机信息
-  miners.modify( miner, same_payer, [&]( auto &row ) {
-    check(row.prod_space <= max_space, "invalid max_space");      
+  auto stat = _miner_stats.require_find( minerid, "minerid not register" );
+  check( stat->prod_space <= max_space, "invalid max_space" );
+  _miners.modify( miner, same_payer, [&]( auto &row ) {
     row.max_space = max_space;
   });
 }
@@ -874,8 +1619,7 @@ void store::chgdeposit( const name& user, uint64_t minerid, bool is_increase, as
   check( quant.symbol == CORE_SYMBOL, "must use core asset for hdd deposit." );
   check( quant.amount > 0, "must use positive quant" );
   
-  miners_table miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
   check( miner->depacc == user, "must use same account to change deposit." );
 
   require_auth( miner->depacc ); // need hdd official account to sign this void.
@@ -883,25 +1627,24 @@ void store::chgdeposit( const name& user, uint64_t minerid, bool is_increase, as
   bool is_frozen = token::is_frozen( TOKEN_ACCOUNT, miner->depacc );
   check( !is_frozen, "miner's depacc is frozen" );
 
-  deposits_table deposits( get_self(), get_self().value );
-  auto deposit = deposits.require_find( miner->depacc.value, "no deposit record for this minerid." );
+  auto deposit = _deposits.require_find( miner->depacc.value, "no deposit record for this minerid." );
 
   if( !is_increase ) {
     check( miner->deposit.amount >= quant.amount, "overdrawn deposit." );
 
-    deposits.modify( deposit, same_payer, [&]( auto& row ) {
+    _deposits.modify( deposit, same_payer, [&]( auto& row ) {
       row.deposit_used -= quant;
     });
-    miners.modify( miner, same_payer, [&]( auto& row ) {
+    _miners.modify( miner, same_payer, [&]( auto& row ) {
       row.deposit -= quant;
       row.dep_total -= quant;
     });
   } else {
     check( deposit->deposit_total.amount - deposit->deposit_used.amount >= quant.amount, "free deposit not enough." );
-    deposits.modify( deposit, same_payer, [&]( auto& row ) {
+    _deposits.modify( deposit, same_payer, [&]( auto& row ) {
       row.deposit_used += quant;
     });
-    miners.modify( miner, same_payer, [&]( auto& row ) {
+    _miners.modify( miner, same_payer, [&]( auto& row ) {
       row.deposit += quant;
       row.dep_total += quant;
     });
@@ -929,17 +1672,15 @@ void store::payforfeit( const name& user, uint64_t minerid, asset quant, uint8_t
   check( quant.symbol == CORE_SYMBOL, "must use core asset for hdd deposit." );
   check( quant.amount > 0, "must use positive quant" );
 
-  miners_table   miners( get_self(), get_self().value );
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  auto miner = require_find_miner( minerid, "minerid not register" );
   check( miner->deposit.amount >= quant.amount, "overdrawn deposit." );
 
-  deposits_table deposits( get_self(), get_self().value );
-  auto deposit = deposits.require_find( miner->depacc.value, "no deposit pool record for this miner." );
+  auto deposit = _deposits.require_find( miner->depacc.value, "no deposit pool record for this miner." );
   
   check( deposit->deposit_used.amount >= quant.amount, "overdrawn deposit." );
 
   // 扣除矿机押金
-  miners.modify( miner, same_payer, [&]( auto& row ) {
+  _miners.modify( miner, same_payer, [&]( auto& row ) {
     row.deposit.amount -= quant.amount;
   });
 
@@ -947,12 +1688,58 @@ void store::payforfeit( const name& user, uint64_t minerid, asset quant, uint8_t
   systransfer( miner->depacc, FORFEIT_ACCOUNT, quant, "pay forfeit" );
 
   // 扣除抵押账号押金
-  deposits.modify( deposit, same_payer, [&]( auto& row ) {
+  _deposits.modify( deposit, same_payer, [&]( auto& row ) {
     row.deposit_total -= quant;
     row.deposit_used -= quant;
   });
 }
 
+// 矿机批量扣除罚金，按抵押账号汇总后每个账号只修改押金和转账一次
+void store::payforfeits( const vector<miner_forfeit>& forfeits, uint8_t acc_type, const name& caller )
+{
+  if( acc_type == 2 ) {
+    // check_admin_account 尚未实现，只验证签名，批量扣除任意矿机的押金只允许管理员账户列表中的账户
+    check( is_account( caller ), "caller not a account.");
+    check( std::find( std::begin( admins ), std::end( admins ), caller ) != std::end( admins ), "caller is not an administrator" );
+    require_auth( caller );
+  } else {
+    require_auth( get_self() );
+  }
+  check( !forfeits.empty(), "forfeits is empty" );
+
+  // 抵押账号 => 罚金总额
+  std::map<uint64_t, asset> depacc_forfeits;
+  for ( const auto& f : forfeits ) {
+    check( f.quant.symbol == CORE_SYMBOL, "must use core asset for hdd deposit." );
+    check( f.quant.amount > 0, "must use positive quant" );
+
+    auto miner = require_find_miner( f.minerid, "minerid not register" );
+    check( miner->deposit.amount >= f.quant.amount, "overdrawn deposit." );
+
+    // 扣除矿机押金
+    _miners.modify( miner, same_payer, [&]( auto& row ) {
+      row.deposit.amount -= f.quant.amount;
+    });
+
+    auto sum = depacc_forfeits.emplace( miner->depacc.value, asset( 0, CORE_SYMBOL ) ).first;
+    sum->second += f.quant;
+  }
+
+  for ( const auto& [depacc, quant] : depacc_forfeits ) {
+    auto deposit = _deposits.require_find( depacc, "no deposit pool record for this miner." );
+    check( deposit->deposit_used.amount >= quant.amount, "overdrawn deposit." );
+
+    // 跨合约扣除token
+    systransfer( name( depacc ), FORFEIT_ACCOUNT, quant, "pay forfeit" );
+
+    // 扣除抵押账号押金
+    _deposits.modify( deposit, same_payer, [&]( auto& row ) {
+      row.deposit_total -= quant;
+      row.deposit_used -= quant;
+    });
+  }
+}
+
 
 
 
@@ -967,18 +1754,17 @@ void store::regstrpool( const name& pool_id, const name& pool_owner )
 {
   require_auth( pool_owner );
 
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto existing = store_pools.find( pool_id.value );
-  check( existing == store_pools.end(), "storepool already registered" );
+  auto existing = _store_pools.find( pool_id.value );
+  check( existing == _store_pools.end(), "storepool already registered" );
 
-  store_pools.emplace( pool_owner, [&]( auto &row ) {
+  _store_pools.emplace( pool_owner, [&]( auto &row ) {
     row.id         = pool_id;
     row.owner      = pool_owner;
   });
 
   // 扣除10个代币
   asset quant( 100000, CORE_SYMBOL );
-  systransfer( pool_owner, HDD_ACCOUNT, quant, "pay for creation storepool " + pool_id.to_string() );
+  pay_to_hdd_account( pool_owner, quant, "pay for creation storepool " + pool_id.to_string() );
 }
 
 // 删除矿池
@@ -986,10 +1772,9 @@ void store::delstrpool( const name& pool_id )
 {
   require_auth( POOL_ADMIN );
 
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool = store_pools.require_find( pool_id.value, "the store pool is not registered" );
+  auto store_pool = _store_pools.require_find( pool_id.value, "the store pool is not registered" );
   check( store_pool->prod_space == 0, "can not delete this storepool." );
-  store_pools.erase( store_pool );
+  _store_pools.erase( store_pool );
 }
 
 // 修改矿池配额
@@ -999,8 +1784,7 @@ void store::chgpoolspace( const name& pool_id, bool is_increase, uint64_t delta_
 
   check( delta_space > 0, "must use positive delta_space" );
 
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool = store_pools.require_find( pool_id.value, "storepool not exist" );
+  auto store_pool = _store_pools.require_find( pool_id.value, "storepool not exist" );
 
   uint64_t max_space = 0;
   if( is_increase ) {
@@ -1011,12 +1795,131 @@ void store::chgpoolspace( const name& pool_id, bool is_increase, uint64_t delta_
     max_space = store_pool->max_space - delta_space;
   }
 
-  store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
+  _store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
     check( row.prod_space <= max_space, "invalid max_space" );
     row.max_space = max_space;
   });
 }
 
+// 按 poolid 索引迁移矿池中的矿机，迁移后的矿机离开原矿池的索引区间，索引区间的起点就是下一次迁移的位置
+// 两个矿池的已使用配额每次只修改一次
+void store::migratepool( const name& from_pool, const name& to_pool, uint32_t limit )
+{
+  require_auth( POOL_ADMIN );
+
+  check( from_pool != to_pool, "must migrate to a different storepool" );
+  check( limit > 0, "limit must be positive" );
+  check_miners_migrated();
+
+  auto pool_from = _store_pools.require_find( from_pool.value, "original storepool not registered" );
+  auto pool_to = _store_pools.require_find( to_pool.value, "storepool not registered" );
+
+  // 与 addm2pool 相同，加入矿池需要目标矿池所有者同意
+  require_auth( pool_to->owner );
+
+  // 修改在action结束时才写入，遍历期间索引不变
+  auto idx = _miners.table().get_index<"poolid"_n>();
+  auto itr = idx.lower_bound( from_pool.value );
+  uint64_t moved_space = 0;
+  uint32_t count = 0;
+  while ( itr != idx.end() && itr->pool_id == from_pool && count < limit ) {
+    auto miner = _miners.find( itr->id );
+    _miners.modify( miner, same_payer, [&]( auto &row ) {
+      row.pool_id = to_pool;
+    });
+    moved_space += miner->max_space;
+    count++;
+    ++itr;
+  }
+
+  if ( count > 0 ) {
+    _store_pools.modify( pool_from, same_payer, [&]( auto &row ) {
+      check( row.prod_space >= moved_space, "over space" );
+      row.prod_space -= moved_space;
+    });
+
+    _store_pools.modify( pool_to, same_payer, [&]( auto &row ) {
+      check( row.max_space - row.prod_space >= moved_space, "pool space not enough" );
+      row.prod_space += moved_space;
+    });
+  }
+
+  bool done = itr == idx.end() || itr->pool_id != from_pool;
+  print( "{\"moved\":", count, ",\"done\":", done ? "true" : "false", "}" );
+}
+
+// 矿池中的矿机全部更改为不活跃
+void store::pooldeactive( const name& pool_id, uint32_t limit )
+{
+  set_pool_miners_active( pool_id, limit, false );
+}
+
+// 矿池中的矿机全部更改为活跃
+void store::poolactive( const name& pool_id, uint32_t limit )
+{
+  set_pool_miners_active( pool_id, limit, true );
+}
+
+
+
+/**********************************************************************************************
+*                                                                                            *
+*                                            只读查询                                         *
+*                                                                                            *
+*********************************************************************************************/
+
+// 按主键顺序分页查询用户，两种格式的用户表合并遍历，返回表中保存的值
+store::user_page store::listusers( const name& lower_bound, uint32_t limit )
+{
+  check( limit > 0, "limit must be positive" );
+
+  user_page page;
+  page.next = name( for_each_user( lower_bound.value, limit, [&]( uint64_t pk ) {
+    const auto& row = *_users.find( pk );
+    page.users.push_back( user_info{
+      row.owner, row.hdds, row.used_space, row.hdds_per_cycle_fee, row.hdds_last_update_time,
+      row.hddm, row.prod_space, row.hddm_per_cycle_profit, row.hddm_last_update_time,
+      row.hddm_acc_snapshot.value_or( 0 )
+    });
+  }) );
+  return page;
+}
+
+// 查询用户余额，在行的副本上按与结算相同的方法计算，不写入数据
+store::balance_info store::projbalance( const name& user )
+{
+  auto _user = _users.require_find( user.value, "the user is not create" );
+
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  uint64_t tmp_t = current_time();
+
+  auto row = *_user;
+  settle_user_hdds( row, fee_epochs, hdds_fee_acc_at( fee_epochs, tmp_t ), tmp_t );
+  settle_user_hddm( row, current_hddm_acc( tmp_t ), tmp_t );
+
+  return balance_info{ row.hdds, row.hddm, get_pending_credit( get_self(), user ) };
+}
+
+// 查询购买hdd需要支付的token
+asset store::quotebuy( int64_t amount )
+{
+  check( is_hdd_amount_within_range( amount ), "magnitude of amount must be less than 2^62" );
+  return asset( calc_buy_token_amount( amount, _sysinfo.get() ), CORE_SYMBOL );
+}
+
+// 查询出售hddm获得的token
+asset store::quotesell( int64_t amount )
+{
+  check( is_hdd_amount_within_range( amount ), "magnitude of amount must be less than 2^62" );
+  return asset( calc_sell_token_amount( amount, _sysinfo.get() ), CORE_SYMBOL );
+}
+
+// 查询矿机空间需要的押金
+asset store::depositreq( uint64_t max_space )
+{
+  return asset( calc_deposit_required( max_space, _sysinfo.get().rate ), CORE_SYMBOL );
+}
+
 
 
 /**********************************************************************************************
@@ -1038,71 +1941,528 @@ void store::check_admin_account( name admin_acc, uint64_t id, bool isCheckId )
 // 计算余额
 int64_t store::calculate_balance( int64_t oldbalance, int64_t hdds_per_cycle_fee, int64_t hddm_per_cycle_profit, uint64_t last_update_time, uint64_t current_time )
 {
-  uint64_t slot_t = ( current_time - last_update_time ) / 1000ll; // convert to milliseconds
-  int64_t new_balance = oldbalance;
+  return billing::calculate_balance( oldbalance, hdds_per_cycle_fee, hddm_per_cycle_profit, last_update_time, current_time );
+}
 
-  double tick = (double)( (double)slot_t / fee_cycle );
-  int64_t delta = (int64_t)( tick * ( hddm_per_cycle_profit - hdds_per_cycle_fee ) );
-  new_balance += delta;
+// 按主键顺序合并遍历两种格式的用户表
+template<typename F>
+uint64_t store::for_each_user( uint64_t lower_bound, uint32_t limit, F&& f )
+{
+  auto& users_v2 = _users.table();
+  auto& users = _users.legacy_table();
+  auto itr_v2 = users_v2.lower_bound( lower_bound );
+  auto itr = users.lower_bound( lower_bound );
+
+  uint32_t count = 0;
+  while ( count < limit && ( itr_v2 != users_v2.end() || itr != users.end() ) ) {
+    if ( itr == users.end() || ( itr_v2 != users_v2.end() && itr_v2->primary_key() < itr->primary_key() ) ) {
+      f( itr_v2->primary_key() );
+      ++itr_v2;
+    } else {
+      f( itr->primary_key() );
+      ++itr;
+    }
+    count++;
+  }
 
-  check( is_hdd_amount_within_range( new_balance ), "magnitude of user hdds must be less than 2^62" );
+  if ( itr_v2 != users_v2.end() && ( itr == users.end() || itr_v2->primary_key() < itr->primary_key() ) ) {
+    return itr_v2->primary_key();
+  } else if ( itr != users.end() ) {
+    return itr->primary_key();
+  }
+  return 0;
+}
 
-  return new_balance;
+// 该行是否已经计入统计，initstats 按 stage 顺序、每个 stage 内按主键顺序统计
+bool store::netstats_counted( uint8_t stage, uint64_t pk )
+{
+  if ( !_netstats.exists() ) {
+    return false;
+  }
+  const auto& stats = _netstats.get();
+  return stats.stage > stage || ( stats.stage == stage && pk < stats.cursor );
 }
 
-// 结算用户的hdd
-void store::update_hdd_balance( users_table& users, const name& acc, bool is_hdds )
+// 按本次action中用户表和抵押表的变化增量更新全网统计
+// initstats 完成前，只累计已经统计过的行，未统计的行在统计时按最新数据计入
+void store::update_netstats()
 {
-  auto user = users.require_find( acc.value, "the user is not create" );
-  users.modify( user, same_payer, [&]( auto &row ) {
-    uint64_t tmp_t = current_time();
-    if ( is_hdds ) {
-      row.hdds = calculate_balance( user->hdds, user->hdds_per_cycle_fee, 0, user->hdds_last_update_time, tmp_t );
-      row.hdds_last_update_time = tmp_t;
-      print("{\"balance\":", row.hdds, "}");
-    } else {
-      row.hddm = calculate_balance( user->hddm, 0, user->hddm_per_cycle_profit, user->hddm_last_update_time, tmp_t );
-      row.hddm_last_update_time = tmp_t;
-      print("{\"balance\":", row.hddm, "}");
+  if ( !_netstats.exists() ) {
+    return;
+  }
+  auto counted = [&]( uint8_t stage, uint64_t pk ) {
+    return netstats_counted( stage, pk );
+  };
+
+  int64_t used_space = 0, prod_space = 0, hdds = 0, hddm = 0, deposit_used = 0;
+  _users.for_each_change( [&]( const user* before, const user* after ) {
+    if ( !counted( netstats_stage::users, ( before ? before : after )->primary_key() ) ) {
+      return;
+    }
+    if ( before ) {
+      used_space -= before->used_space;
+      prod_space -= before->prod_space;
+      hdds -= before->hdds;
+      hddm -= before->hddm;
+    }
+    if ( after ) {
+      used_space += after->used_space;
+      prod_space += after->prod_space;
+      hdds += after->hdds;
+      hddm += after->hddm;
     }
   });
+  _deposits.for_each_change( [&]( const deposit* before, const deposit* after ) {
+    if ( !counted( netstats_stage::deposits, ( before ? before : after )->primary_key() ) ) {
+      return;
+    }
+    if ( before ) {
+      deposit_used -= before->deposit_used.amount;
+    }
+    if ( after ) {
+      deposit_used += after->deposit_used.amount;
+    }
+  });
+
+  if ( used_space == 0 && prod_space == 0 && hdds == 0 && hddm == 0 && deposit_used == 0 ) {
+    return;
+  }
+  auto& changed = _netstats.modify();
+  changed.used_space += used_space;
+  changed.prod_space += prod_space;
+  changed.hdds += hdds;
+  changed.hddm += hddm;
+  changed.deposit_used += deposit_used;
 }
 
-// 更新矿机的hddm
-void store::update_miner_hddm_balance( miners_table& miners, uint64_t minerid )
+// 按本次action中矿机表和矿机收益表的变化增量更新矿池统计
+// 只有矿机的所属矿池、生产空间和周期收益会影响矿池统计，两张表中只修改了一张时另一张按当前值计算
+void store::update_pool_stats()
 {
-  auto miner = miners.require_find( minerid, "minerid not register" );
+  if ( !_netstats.exists() ) {
+    return;
+  }
+  auto counted = [&]( uint64_t minerid ) {
+    return netstats_counted( netstats_stage::miners, minerid );
+  };
+
+  // 矿机id => 修改前后的行
+  std::map<uint64_t, std::pair<const miner*, const miner*>> miner_changes;
+  _miners.for_each_change( [&]( const miner* before, const miner* after ) {
+    uint64_t id = ( before ? before : after )->id;
+    if ( counted( id ) ) {
+      miner_changes[id] = { before, after };
+    }
+  });
+  std::map<uint64_t, std::pair<const miner_stat*, const miner_stat*>> stat_changes;
+  _miner_stats.for_each_change( [&]( const miner_stat* before, const miner_stat* after ) {
+    uint64_t id = ( before ? before : after )->id;
+    if ( counted( id ) ) {
+      stat_changes[id] = { before, after };
+    }
+  });
+  for ( const auto& [id, change] : stat_changes ) {
+    if ( miner_changes.count( id ) == 0 ) {
+      auto miner = _miners.find( id );
+      miner_changes[id] = { miner, miner };
+    }
+  }
 
-  miners.modify( miner, same_payer, [&]( auto &row ) {
-    uint64_t tmp_t = current_time();
-    row.total_profit = calculate_balance( miner->total_profit , 0, miner->hddm_per_cycle_profit, miner->hddm_last_update_time, tmp_t );
-    row.hddm_last_update_time = tmp_t;
+  // 矿池id => 矿机数量、活跃生产空间和周期收益的变化
+  std::map<uint64_t, std::tuple<int64_t, int64_t, int64_t>> pool_deltas;
+  auto add = [&]( const miner* m, const miner_stat* st, int64_t sign ) {
+    if ( m == nullptr || m->pool_id.value == 0 ) {
+      return;
+    }
+    auto& [miner_count, active_space, profit] = pool_deltas[m->pool_id.value];
+    miner_count += sign;
+    if ( st != nullptr && st->hddm_per_cycle_profit > 0 ) {
+      active_space += sign * int64_t( st->prod_space );
+      profit += sign * int64_t( st->hddm_per_cycle_profit );
+    }
+  };
+  for ( const auto& [id, change] : miner_changes ) {
+    const miner_stat* stat_before;
+    const miner_stat* stat_after;
+    auto stat_change = stat_changes.find( id );
+    if ( stat_change != stat_changes.end() ) {
+      stat_before = stat_change->second.first;
+      stat_after = stat_change->second.second;
+    } else {
+      stat_before = stat_after = _miner_stats.find( id );
+    }
+    add( change.first, stat_before, -1 );
+    add( change.second, stat_after, 1 );
+  }
+
+  for ( const auto& [pool_id, delta] : pool_deltas ) {
+    const auto& [miner_count, active_space, profit] = delta;
+    if ( miner_count == 0 && active_space == 0 && profit == 0 ) {
+      continue;
+    }
+    auto store_pool = _store_pools.find( pool_id );
+    if ( store_pool == _store_pools.end() ) {
+      continue;
+    }
+    _store_pools.modify( store_pool, same_payer, [&]( auto &row ) {
+      auto pool_stats = row.stats.value_or();
+      pool_stats.miner_count += miner_count;
+      pool_stats.active_space += active_space;
+      pool_stats.hddm_per_cycle_profit += profit;
+      row.stats.emplace( pool_stats );
+    });
+  }
+}
+
+// 按本次action中用户表的变化更新欠费索引，预计耗尽时间没有变化的用户不读写索引
+void store::update_delinquency()
+{
+  fee_epochs_table fee_epochs( get_self(), get_self().value );
+  delinquency_table delinquencies( get_self(), get_self().value );
+  uint64_t price = 0;
+  uint64_t now = 0;
+  bool price_loaded = false;
+
+  _users.for_each_change( [&]( const user* before, const user* after ) {
+    if ( !price_loaded ) {
+      price = current_fee_price( fee_epochs );
+      now = current_time();
+      price_loaded = true;
+    }
+    if ( after == nullptr ) {
+      auto itr = delinquencies.find( before->owner.value );
+      if ( itr != delinquencies.end() ) {
+        delinquencies.erase( itr );
+      }
+      return;
+    }
+    if ( before != nullptr && projected_exhaust_time( *before, price ) == projected_exhaust_time( *after, price ) ) {
+      return;
+    }
+    set_delinquency( delinquencies, *after, price, now );
   });
 }
 
+// 更新一个用户的欠费索引，余额不会耗尽时删除
+// 结算时时长截断到秒、费用向零截断，几乎每次结算都会让预计耗尽时间变化几毫秒
+// 尚未到期的用户变化不超过一个计费周期时不改写，最多晚一个计费周期被 sweepdelinq 处理
+// 已经到期的用户总是改写，sweepdelinq 结算后仍然欠费的用户排到后面
+void store::set_delinquency( delinquency_table& delinquencies, const user& row, uint64_t price, uint64_t now )
+{
+  uint64_t exhaust_time = projected_exhaust_time( row, price );
+  auto itr = delinquencies.find( row.owner.value );
+  if ( exhaust_time == UINT64_MAX ) {
+    if ( itr != delinquencies.end() ) {
+      delinquencies.erase( itr );
+    }
+  } else if ( itr == delinquencies.end() ) {
+    delinquencies.emplace( get_self(), [&]( auto &r ) {
+      r.owner        = row.owner;
+      r.exhaust_time = exhaust_time;
+    });
+  } else if ( itr->exhaust_time != exhaust_time ) {
+    uint64_t diff = itr->exhaust_time > exhaust_time ? itr->exhaust_time - exhaust_time : exhaust_time - itr->exhaust_time;
+    if ( itr->exhaust_time > now && diff < fee_cycle ) {
+      return;
+    }
+    delinquencies.modify( itr, same_payer, [&]( auto &r ) {
+      r.exhaust_time = exhaust_time;
+    });
+  }
+}
+
+// 结算用户的hdd，返回结算后的余额
+int64_t store::update_hdd_balance( const name& acc, bool is_hdds )
+{
+  auto user = _users.require_find( acc.value, "the user is not create" );
+
+  uint64_t tmp_t = current_time();
+  if ( is_hdds ) {
+    fee_epochs_table fee_epochs( get_self(), get_self().value );
+    uint64_t fee_acc_now = hdds_fee_acc_at( fee_epochs, tmp_t );
+    _users.modify( user, same_payer, [&]( auto &row ) {
+      settle_user_hdds( row, fee_epochs, fee_acc_now, tmp_t );
+    });
+    return user->hdds;
+  } else {
+    uint64_t acc_now = current_hddm_acc( tmp_t );
+    _users.modify( user, same_payer, [&]( auto &row ) {
+      settle_user_hddm( row, acc_now, tmp_t );
+    });
+    return user->hddm;
+  }
+}
+
+// 截至 time 每单位占用空间的累计存储费用 = 所在区间之前的累计费用 + 区间内 (time - start_time) / fee_cycle * price
+uint64_t store::hdds_fee_acc_at( const fee_epochs_table& epochs, uint64_t time ) const
+{
+  auto epoch = epochs.upper_bound( time );
+  if ( epoch == epochs.begin() ) {
+    return 0;
+  }
+  --epoch;
+
+  uint64_t slot_t = ( time - epoch->start_time ) / 1000ll;
+  uint128_t delta = fixmath::muldiv( slot_t, epoch->price, fee_cycle, rounding::toward_zero );
+  return fixmath::to_uint64( delta + epoch->acc_fee );
+}
+
+// 当前存储费用价格，即最后一个价格区间的价格
+uint64_t store::current_fee_price( const fee_epochs_table& epochs ) const
+{
+  auto last = epochs.end();
+  if ( last == epochs.begin() ) {
+    return 0;
+  }
+  --last;
+  return last->price;
+}
+
+// 预计耗尽时间 = hdds_last_update_time + hdds / (周期费用 + 占用空间 * 价格) * fee_cycle
+// 与结算相同，时长按 (now - last_update_time) / 1000 计入，因此再乘以1000
+uint64_t store::projected_exhaust_time( const user& row, uint64_t price ) const
+{
+  // 每周期的总费用，放大 hdds_fee_precision 倍
+  uint128_t rate = fixmath::mul( row.hdds_per_cycle_fee, hdds_fee_precision ) + fixmath::mul( row.used_space, price );
+  if ( row.hdds < 0 || ( row.hdds == 0 && rate > 0 ) ) {
+    return row.hdds_last_update_time;
+  }
+  if ( rate == 0 ) {
+    return UINT64_MAX;
+  }
+
+  uint128_t num = fixmath::mul( uint64_t(row.hdds), fixmath::mul( fee_cycle, 1000 ) );
+  uint128_t duration;
+  if ( num <= fixmath::uint128_max / hdds_fee_precision ) {
+    duration = fixmath::muldiv( num, hdds_fee_precision, rate, rounding::toward_zero );
+  } else {
+    // 余额很大时先缩小费用避免溢出，误差只影响很久以后的时间
+    duration = fixmath::div( num, fixmath::div( rate, hdds_fee_precision, rounding::away_from_zero ), rounding::toward_zero );
+  }
+  if ( duration >= UINT64_MAX - row.hdds_last_update_time ) {
+    return UINT64_MAX;
+  }
+  return row.hdds_last_update_time + uint64_t(duration);
+}
+
+// 结算后的hdds = hdds - 周期费用 * 时长 - used_space * (当前累计费用 - 上次结算时累计费用)
+int64_t store::settled_hdds( int64_t hdds, uint64_t used_space, uint64_t fee, uint64_t last_update_time, const fee_epochs_table& epochs, uint64_t fee_acc_now, uint64_t now )
+{
+  int64_t new_balance = calculate_balance( hdds, fee, 0, last_update_time, now );
+
+  if ( used_space > 0 && fee_acc_now > 0 ) {
+    uint64_t fee_acc_last = hdds_fee_acc_at( epochs, last_update_time );
+    uint128_t space_fee = fixmath::muldiv( used_space, fee_acc_now - fee_acc_last, hdds_fee_precision, rounding::toward_zero );
+    new_balance = fixmath::to_int64( int128_t(new_balance) - int128_t(space_fee) );
+    check( is_hdd_amount_within_range( new_balance ), "magnitude of user hdds must be less than 2^62" );
+  }
+  return new_balance;
+}
+
+// 结算用户hdds
+void store::settle_user_hdds( user& row, const fee_epochs_table& epochs, uint64_t fee_acc_now, uint64_t now )
+{
+  row.hdds = settled_hdds( row.hdds, row.used_space, row.hdds_per_cycle_fee, row.hdds_last_update_time, epochs, fee_acc_now, now );
+  row.hdds_last_update_time = now;
+}
+
+// 修改系统参数，migsysinfo 之前 sysinfo 仍是旧版格式，按新格式写回会丢掉末尾的统计数据
+store::sysinfo& store::modify_sysinfo()
+{
+  check( _syscounter.exists(), "sysinfo is not migrated, run migsysinfo first" );
+  return _sysinfo.modify();
+}
+
+// 可选模式设置
+store::sysopts store::get_sysopts() const
+{
+  sysopts_singleton sys_opts( get_self(), get_self().value );
+  return sys_opts.get_or_default();
+}
+
+// 当前每单位生产空间的周期收益
+uint64_t store::current_profit_per_space() const
+{
+  hddm_acc_singleton _hddm_acc( get_self(), get_self().value );
+  return _hddm_acc.get_or_default( hddm_acc{ 0, 0, default_profit_per_space } ).profit_per_space;
+}
+
+// 当前每单位生产空间的累计收益 = acc + (now - last_update_time) / fee_cycle * profit_per_space
+uint64_t store::current_hddm_acc( uint64_t now ) const
+{
+  hddm_acc_singleton _hddm_acc( get_self(), get_self().value );
+  auto acc = _hddm_acc.get_or_default( hddm_acc{ 0, 0, default_profit_per_space } );
+
+  uint64_t slot_t = ( now - acc.last_update_time ) / 1000ll;
+  uint128_t delta = fixmath::muldiv( slot_t, acc.profit_per_space, fee_cycle, rounding::toward_zero );
+  return fixmath::to_uint64( delta + acc.acc );
+}
+
+// 收益 = space * (当前累计收益 - 快照)
+uint128_t store::accrued_hddm( uint64_t space, uint64_t acc_now, uint64_t snapshot ) const
+{
+  return fixmath::muldiv( space, acc_now - snapshot, hddm_acc_precision, rounding::toward_zero );
+}
+
+// 结算用户hddm
+void store::settle_user_hddm( user& row, uint64_t acc_now, uint64_t now )
+{
+  if ( row.hddm_acc_snapshot.has_value() ) {
+    uint128_t delta = accrued_hddm( row.prod_space, acc_now, row.hddm_acc_snapshot.value() );
+    row.hddm = fixmath::to_int64( int128_t(delta) + row.hddm );
+    check( is_hdd_amount_within_range( row.hddm ), "magnitude of user hddm must be less than 2^62" );
+  } else {
+    // 没有快照的旧数据，按周期收益结算一次
+    row.hddm = calculate_balance( row.hddm, 0, row.hddm_per_cycle_profit, row.hddm_last_update_time, now );
+  }
+  row.hddm_acc_snapshot.emplace( acc_now );
+  row.hddm_last_update_time = now;
+}
+
+// 结算矿机收益，不活跃的矿机没有收益
+void store::settle_miner_hddm( miner_stat& row, uint64_t acc_now, uint64_t now )
+{
+  if ( row.hddm_per_cycle_profit > 0 ) {
+    uint128_t delta = accrued_hddm( row.prod_space, acc_now, row.hddm_acc_snapshot );
+    row.total_profit = fixmath::to_uint64( delta + row.total_profit );
+  }
+  row.hddm_acc_snapshot = acc_now;
+  row.hddm_last_update_time = now;
+}
+
+// 矿机计入收益账号的生产空间从 before 变为 after，周期收益按当前收益率重新计算，调用前先结算hddm
+void store::update_owner_space( user& row, uint64_t before, uint64_t after, uint64_t profit_per_space )
+{
+  row.prod_space = billing::move_owner_space( row.prod_space, before, after );
+  row.hddm_per_cycle_profit = calc_hddm_per_cycle_profit( row.prod_space, profit_per_space );
+}
+
+// 按 poolid 索引分页修改矿机的活跃状态，状态已经符合的矿机跳过
+// 同一收益账号的周期收益和生产空间变化先汇总，每页只结算一次
+void store::set_pool_miners_active( const name& pool_id, uint32_t limit, bool active )
+{
+  require_auth( get_miner_pool_owner( pool_id ) );
+  check( limit > 0, "limit must be positive" );
+  check_miners_migrated();
+
+  uint8_t op = active ? pool_op::active : pool_op::deactive;
+  auto& miners = _miners.table();
+  auto idx = miners.get_index<"poolid"_n>();
+
+  // 从上次的位置继续，操作不同或者该矿机已经不在矿池中时从头开始
+  pool_cursors_table pool_cursors( get_self(), get_self().value );
+  auto cursor = pool_cursors.find( pool_id.value );
+  auto itr = idx.lower_bound( pool_id.value );
+  if ( cursor != pool_cursors.end() && cursor->op == op ) {
+    auto next = miners.find( cursor->next_minerid );
+    if ( next != miners.end() && next->pool_id == pool_id ) {
+      itr = idx.iterator_to( *next );
+    }
+  }
+
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  uint64_t profit_per_space = current_profit_per_space();
+
+  // 收益账号 => 计入生产空间的减少和增加
+  std::map<uint64_t, std::pair<uint64_t, uint64_t>> owner_deltas;
+  uint32_t count = 0;
+  for ( ; itr != idx.end() && itr->pool_id == pool_id && count < limit; ++itr, ++count ) {
+    auto stat = _miner_stats.require_find( itr->id, "minerid not register" );
+    if ( stat->prod_space == 0 || ( stat->hddm_per_cycle_profit > 0 ) == active ) {
+      continue;
+    }
+
+    int64_t profit = active ? calc_hddm_per_cycle_profit( stat->prod_space, profit_per_space ) : 0;
+    auto& delta = owner_deltas[itr->owner.value];
+    delta.first += billing::owner_counted_space( stat->prod_space, stat->hddm_per_cycle_profit );
+    delta.second += billing::owner_counted_space( stat->prod_space, profit );
+
+    _miner_stats.modify( stat, same_payer, [&]( auto &row ) {
+      settle_miner_hddm( row, acc_now, tmp_t );
+      row.hddm_per_cycle_profit = profit;
+    });
+  }
+
+  for ( const auto& [owner, delta] : owner_deltas ) {
+    auto user = _users.require_find( owner, "the miner's owner is not exist" );
+    _users.modify( user, same_payer, [&]( auto& row ) {
+      settle_user_hddm( row, acc_now, tmp_t );
+      update_owner_space( row, delta.first, delta.second, profit_per_space );
+    });
+  }
+
+  bool done = itr == idx.end() || itr->pool_id != pool_id;
+  if ( done ) {
+    if ( cursor != pool_cursors.end() ) {
+      pool_cursors.erase( cursor );
+    }
+  } else if ( cursor == pool_cursors.end() ) {
+    pool_cursors.emplace( get_self(), [&]( auto &row ) {
+      row.pool_id      = pool_id;
+      row.op           = op;
+      row.next_minerid = itr->id;
+    });
+  } else {
+    pool_cursors.modify( cursor, same_payer, [&]( auto &row ) {
+      row.op           = op;
+      row.next_minerid = itr->id;
+    });
+  }
+  print( "{\"processed\":", count, ",\"done\":", done ? "true" : "false", "}" );
+}
+
 // 获取矿池所有者
 name store::get_miner_pool_owner( name pool_id )
 {
-  store_pools_table store_pools( get_self(), get_self().value );
-  auto store_pool = store_pools.require_find( pool_id.value, "the pool_id is not exist" );
+  auto store_pool = _store_pools.require_find( pool_id.value, "the pool_id is not exist" );
   return store_pool->owner;
 }
 
 // 抵押是否足够
-bool store::is_deposit_enough( asset deposit, uint64_t space ) const
+bool store::is_deposit_enough( asset deposit, uint64_t space )
 {
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
-  int64_t rate = sinfo.rate;
-  double drate = ((double)rate) / 100;
+  const auto& sinfo = _sysinfo.get();
 
-  int64_t am = (int64_t)((((double)space) / one_gb) * drate * 10000);
+  int64_t am = calc_deposit_required( space, sinfo.rate );
   if (deposit.amount >= am)
     return true;
 
   return false;
 }
 
+// 周期收益，见 billing::calc_hddm_per_cycle_profit
+int64_t store::calc_hddm_per_cycle_profit( uint64_t space, uint64_t profit_per_space ) const
+{
+  return billing::calc_hddm_per_cycle_profit( space, profit_per_space );
+}
+
+// 购买hdd所需token，见 billing::calc_buy_token_amount
+int64_t store::calc_buy_token_amount( int64_t amount, const sysinfo& sinfo ) const
+{
+  return billing::calc_buy_token_amount( amount, sinfo.hdd_price, sinfo.token_price );
+}
+
+// 出售hdd获得token，见 billing::calc_sell_token_amount
+int64_t store::calc_sell_token_amount( int64_t amount, const sysinfo& sinfo ) const
+{
+  return billing::calc_sell_token_amount( amount, sinfo.hdd_price, sinfo.token_price, sinfo.dup_remove_ratio, sinfo.dup_remove_dist_ratio );
+}
+
+// 存储周期费用 = 占用空间 * 每单位占用空间的周期费用，向零截断
+uint64_t store::calc_hdds_per_cycle_fee( uint64_t used_space, uint64_t unit_fee ) const
+{
+  uint128_t fee = fixmath::muldiv( used_space, unit_fee, hdds_fee_precision, rounding::toward_zero );
+  check( fee <= uint128_t(max_hdd_amount), "magnitude of fee must be less than 2^62" );
+  return uint64_t(fee);
+}
+
+// 所需押金，见 billing::calc_deposit_required
+int64_t store::calc_deposit_required( uint64_t space, uint64_t rate ) const
+{
+  return billing::calc_deposit_required( space, rate );
+}
+
 // 系统转账
 void store::systransfer( const name& from, const name& to, const asset& quantity, const string& memo )
 {
@@ -1114,19 +2474,78 @@ void store::systransfer( const name& from, const name& to, const asset& quantity
   ).send();
 }
 
+// HDD_ACCOUNT 可以转出的token = 余额 - 抵押，冻结或没有余额时为0，不包括 token 合约的锁仓规则
+int64_t store::hdd_account_available()
+{
+  if ( token::is_frozen( TOKEN_ACCOUNT, HDD_ACCOUNT ) ) {
+    return 0;
+  }
+  raw_row account( TOKEN_ACCOUNT, HDD_ACCOUNT.value, "accounts"_n, CORE_SYMBOL.code().raw() );
+  if ( !account.exists() ) {
+    return 0;
+  }
+  return account.get<int64_t>( 0 ) - get_deposit( get_self(), HDD_ACCOUNT ).amount;
+}
+
+// HDD_ACCOUNT 转给用户，开启合并转账时累加到待转账表
+void store::pay_from_hdd_account( const name& to, const asset& quantity, const string& memo )
+{
+  if ( !get_sysopts().defer_transfers ) {
+    systransfer( HDD_ACCOUNT, to, quantity, memo );
+    return;
+  }
+
+  pending_xfers_table pending_xfers( get_self(), get_self().value );
+  auto pending = pending_xfers.find( to.value );
+  if ( pending == pending_xfers.end() ) {
+    pending_xfers.emplace( get_self(), [&]( auto& row ) {
+      row.owner  = to;
+      row.amount = quantity;
+    });
+  } else {
+    pending_xfers.modify( pending, same_payer, [&]( auto& row ) {
+      row.amount += quantity;
+    });
+  }
+}
+
+// 用户转给 HDD_ACCOUNT，先抵扣 HDD_ACCOUNT 欠用户的待转金额，不足部分立即转账
+// 用户应付的金额不会延后，不会出现用户转走token后无法扣款的情况
+void store::pay_to_hdd_account( const name& from, const asset& quantity, const string& memo )
+{
+  asset remaining = quantity;
+
+  pending_xfers_table pending_xfers( get_self(), get_self().value );
+  auto pending = pending_xfers.find( from.value );
+  if ( pending != pending_xfers.end() ) {
+    if ( pending->amount > remaining ) {
+      pending_xfers.modify( pending, same_payer, [&]( auto& row ) {
+        row.amount -= remaining;
+      });
+      remaining.amount = 0;
+    } else {
+      remaining -= pending->amount;
+      pending_xfers.erase( pending );
+    }
+  }
+
+  if ( remaining.amount > 0 ) {
+    systransfer( from, HDD_ACCOUNT, remaining, memo );
+  }
+}
+
 // 修改抵押金额
 void store::change_deposit_total( const name& owner, bool is_add, asset quant )
 {
   // 扣除抵押账号押金
-  deposits_table deposits( get_self(), get_self().value );
-  auto deposit = deposits.require_find( owner.value, "no deposit pool record for this user." );
+  auto deposit = _deposits.require_find( owner.value, "no deposit pool record for this user." );
   if ( is_add ) {
-    deposits.modify( deposit, same_payer, [&]( auto& row ) {
+    _deposits.modify( deposit, same_payer, [&]( auto& row ) {
       row.deposit_total += quant;
     });
   } else {
     check( deposit->deposit_used.amount >= quant.amount, "overdrawn deposit." );
-    deposits.modify( deposit, same_payer, [&]( auto& row ) {
+    _deposits.modify( deposit, same_payer, [&]( auto& row ) {
       row.deposit_total -= quant;
     });
   }
@@ -1135,18 +2554,18 @@ void store::change_deposit_total( const name& owner, bool is_add, asset quant )
 // 开通user账户
 void store::create_user( const name& user, const name& ram_payer )
 {
-  users_table users( get_self(), get_self().value );
-  auto existing = users.find( user.value );
-  check( existing == users.end(), "the account is already create." );
+  auto existing = _users.find( user.value );
+  check( existing == _users.end(), "the account is already create." );
 
-  users.emplace( ram_payer, [&]( auto &row ){
+  uint64_t tmp_t = current_time();
+  uint64_t acc_now = current_hddm_acc( tmp_t );
+  _users.emplace( ram_payer, [&]( auto &row ){
     row.owner = user;
-    row.hdds_last_update_time = current_time();
-    row.hddm_last_update_time = current_time();
+    row.hdds_last_update_time = tmp_t;
+    row.hddm_last_update_time = tmp_t;
+    row.hddm_acc_snapshot.emplace( acc_now );
   });
 
-  sysinfo_singleton sys_info( get_self(), get_self().value );
-  auto sinfo = sys_info.get();
-  sinfo.user_count += 1;
-  sys_info.set( sinfo, get_self() );
+  auto& counter = _syscounter.modify();
+  counter.user_count += 1;
 }
@@ -0,0 +1,229 @@
+// 计费公式与原先浮点实现的对比测试
+// 普通数值下两者结果相同；数值很大时 double 精度不足，定点结果是精确的向零截断，与 double 相差1
+// 编译运行: ./compile.sh test
+
+#include <billing.hpp>
+
+#include <cstdio>
+
+using namespace billing;
+
+static int failures = 0;
+
+#define EXPECT_EQ( actual, expected ) \
+   do { \
+      long long a_ = (long long)(actual), e_ = (long long)(expected); \
+      if ( a_ != e_ ) { \
+         printf( "%s:%d: %s = %lld, expected %lld\n", __FILE__, __LINE__, #actual, a_, e_ ); \
+         failures++; \
+      } \
+   } while ( 0 )
+
+/**
+ * 原先的浮点实现
+ */
+namespace legacy {
+
+   int64_t calc_hddm_per_cycle_profit( uint64_t space )
+   {
+      return (int64_t)((double)(space / (double)one_gb) * ((double)fee_cycle / (double)milliseconds_in_one_year) * 100000000);
+   }
+
+   int64_t calc_buy_token_amount( int64_t amount, uint64_t hdd_price, uint64_t token_price )
+   {
+      int64_t token_amount = (int64_t)( ((double)amount/10000) * ((double)hdd_price/(double)token_price) );
+      if ( amount % 10000 > 0 ) {
+         token_amount += 1;
+      }
+      return token_amount;
+   }
+
+   int64_t calc_sell_token_amount( int64_t amount, uint64_t hdd_price, uint64_t token_price, uint64_t dup_remove_ratio, uint64_t dup_remove_dist_ratio )
+   {
+      return (int64_t)( ((double)amount/10000) * ((double)hdd_price/(double)token_price) * ((double)dup_remove_ratio/10000) * ((double)dup_remove_dist_ratio/10000) );
+   }
+
+   int64_t calc_deposit_required( uint64_t space, uint64_t rate )
+   {
+      double drate = ((double)rate) / 100;
+      return (int64_t)((((double)space) / one_gb) * drate * 10000);
+   }
+
+   int64_t calculate_balance( int64_t oldbalance, int64_t hdds_per_cycle_fee, int64_t hddm_per_cycle_profit, uint64_t last_update_time, uint64_t current_time )
+   {
+      uint64_t slot_t = ( current_time - last_update_time ) / 1000ll;
+      double tick = (double)( (double)slot_t / fee_cycle );
+      int64_t delta = (int64_t)( tick * ( hddm_per_cycle_profit - hdds_per_cycle_fee ) );
+      return oldbalance + delta;
+   }
+
+} // namespace legacy
+
+static void test_hddm_per_cycle_profit()
+{
+   // 默认收益率下与原先结果相同
+   const uint64_t spaces[] = { 65536, 12345678, 100 * one_gb };
+   for ( uint64_t space : spaces ) {
+      EXPECT_EQ( calc_hddm_per_cycle_profit( space, default_profit_per_space ), legacy::calc_hddm_per_cycle_profit( space ) );
+   }
+   EXPECT_EQ( calc_hddm_per_cycle_profit( 100 * one_gb, default_profit_per_space ), 27397260 );
+
+   // 默认收益率截断到 hddm_acc_precision 精度，空间很大时比原公式略小，与按累计值结算的收益一致
+   EXPECT_EQ( calc_hddm_per_cycle_profit( one_gb * 1024 * 1024 * 500, default_profit_per_space ), 143640547945185ll );
+   EXPECT_EQ( legacy::calc_hddm_per_cycle_profit( one_gb * 1024 * 1024 * 500 ), 143640547945205ll );
+   EXPECT_EQ( calc_hddm_per_cycle_profit( 3350816180764ull, default_profit_per_space ), 14008054051913ll );
+   EXPECT_EQ( legacy::calc_hddm_per_cycle_profit( 3350816180764ull ), 14008054051915ll );
+
+   // 按 setprofrate 设置的收益率计算
+   EXPECT_EQ( calc_hddm_per_cycle_profit( 100 * one_gb, 2 * hddm_acc_precision ), 13107200 );
+}
+
+static void test_buy_token_amount()
+{
+   EXPECT_EQ( calc_buy_token_amount( 200000000, 1000, 1 ), legacy::calc_buy_token_amount( 200000000, 1000, 1 ) );
+   EXPECT_EQ( calc_buy_token_amount( 123456789, 3, 7 ), legacy::calc_buy_token_amount( 123456789, 3, 7 ) );
+   EXPECT_EQ( calc_buy_token_amount( 123456789, 3, 7 ), 5292 );
+   EXPECT_EQ( calc_buy_token_amount( 209715200000000ll, 100000, 3 ), 699050666666666ll );
+   EXPECT_EQ( calc_buy_token_amount( max_hdd_amount, 1, 3 ), legacy::calc_buy_token_amount( max_hdd_amount, 1, 3 ) );
+
+   // double 多算1
+   EXPECT_EQ( calc_buy_token_amount( 1336381801249524472ll, 971513, 22534 ), 5761570484056667ll );
+   EXPECT_EQ( legacy::calc_buy_token_amount( 1336381801249524472ll, 971513, 22534 ), 5761570484056668ll );
+}
+
+static void test_sell_token_amount()
+{
+   EXPECT_EQ( calc_sell_token_amount( 200000000, 1000, 1, 10000, 10000 ), legacy::calc_sell_token_amount( 200000000, 1000, 1, 10000, 10000 ) );
+   EXPECT_EQ( calc_sell_token_amount( 123456789, 3, 7, 9000, 8000 ), legacy::calc_sell_token_amount( 123456789, 3, 7, 9000, 8000 ) );
+   EXPECT_EQ( calc_sell_token_amount( 123456789, 3, 7, 9000, 8000 ), 3809 );
+   EXPECT_EQ( calc_sell_token_amount( 209715200000000ll, 100000, 3, 9999, 7777 ), 543597338296320ll );
+
+   // double 多算1
+   EXPECT_EQ( calc_sell_token_amount( 3297056024948795537ll, 270402, 346154, 8132, 9726 ), 203703507543597ll );
+   EXPECT_EQ( legacy::calc_sell_token_amount( 3297056024948795537ll, 270402, 346154, 8132, 9726 ), 203703507543598ll );
+}
+
+static void test_deposit_required()
+{
+   EXPECT_EQ( calc_deposit_required( 100 * one_gb, 100 ), legacy::calc_deposit_required( 100 * one_gb, 100 ) );
+   EXPECT_EQ( calc_deposit_required( 100 * one_gb, 100 ), 1000000 );
+   EXPECT_EQ( calc_deposit_required( 12345678, 37 ), legacy::calc_deposit_required( 12345678, 37 ) );
+   EXPECT_EQ( calc_deposit_required( one_gb * 1024 * 100, 300 ), legacy::calc_deposit_required( one_gb * 1024 * 100, 300 ) );
+
+   // double 多算1
+   EXPECT_EQ( calc_deposit_required( 579899543538531ull, 866 ), 766285712744701ll );
+   EXPECT_EQ( legacy::calc_deposit_required( 579899543538531ull, 866 ), 766285712744702ll );
+   EXPECT_EQ( calc_deposit_required( UINT64_MAX, 1 ), 28147497671065599ll );
+   EXPECT_EQ( legacy::calc_deposit_required( UINT64_MAX, 1 ), 28147497671065600ll );
+}
+
+static void test_calculate_balance()
+{
+   const uint64_t cycle_seconds = fee_cycle * 1000;   // 时长按 (now - last) / 1000 计入
+   EXPECT_EQ( calculate_balance( 1000000, 5000, 0, 0, cycle_seconds ), legacy::calculate_balance( 1000000, 5000, 0, 0, cycle_seconds ) );
+   EXPECT_EQ( calculate_balance( 1000000, 5000, 0, 0, cycle_seconds ), 995000 );
+   EXPECT_EQ( calculate_balance( 0, 0, 123456789, 1000, cycle_seconds + 1000 ), 123456789 );
+   EXPECT_EQ( calculate_balance( -500, 7, 0, 0, 12345678901ull ), legacy::calculate_balance( -500, 7, 0, 0, 12345678901ull ) );
+   EXPECT_EQ( calculate_balance( -500, 7, 0, 0, 12345678901ull ), -501 );
+   EXPECT_EQ( calculate_balance( 1000000000000000ll, 0, 1000000000000ll, 0, cycle_seconds * 3 ), 1003000000000000ll );
+   EXPECT_EQ( calculate_balance( 1ll << 61, 3, 0, 0, cycle_seconds * 7 ), legacy::calculate_balance( 1ll << 61, 3, 0, 0, cycle_seconds * 7 ) );
+
+   // 扣费时 double 多扣1
+   EXPECT_EQ( calculate_balance( 0, 845409379391789ll, 0, 0, 998527741058ull ), -9770424974818229ll );
+   EXPECT_EQ( legacy::calculate_balance( 0, 845409379391789ll, 0, 0, 998527741058ull ), -9770424974818230ll );
+
+   // 超出范围时报错
+   bool thrown = false;
+   try {
+      calculate_balance( max_hdd_amount, 0, 1, 0, cycle_seconds );
+   } catch ( const std::exception& ) {
+      thrown = true;
+   }
+   EXPECT_EQ( thrown, true );
+}
+
+// 按合约中 mdeactive、mactive 和 addmprofit 修改矿机和收益账号生产空间的步骤模拟
+struct space_sim {
+   uint64_t  miner_space = 0;
+   uint64_t  miner_profit = 0;
+   uint64_t  owner_space = 0;
+
+   bool deactive()
+   {
+      if ( !( miner_profit > 0 && miner_space > 0 ) ) {
+         return false;
+      }
+      owner_space = move_owner_space( owner_space, miner_space, 0 );
+      miner_profit = 0;
+      return true;
+   }
+
+   bool active()
+   {
+      if ( !( miner_profit == 0 && miner_space > 0 ) ) {
+         return false;
+      }
+      miner_profit = calc_hddm_per_cycle_profit( miner_space, default_profit_per_space );
+      owner_space = move_owner_space( owner_space, 0, owner_counted_space( miner_space, miner_profit ) );
+      return true;
+   }
+
+   void add( uint64_t space )
+   {
+      uint64_t before = owner_counted_space( miner_space, miner_profit );
+      miner_profit = calc_miner_profit_after_add( miner_space, miner_profit, space, default_profit_per_space );
+      miner_space += space;
+      owner_space = move_owner_space( owner_space, before, owner_counted_space( miner_space, miner_profit ) );
+   }
+};
+
+static void test_owner_space()
+{
+   // 新矿机增加空间后变为活跃
+   space_sim sim;
+   sim.add( 100 * one_gb );
+   EXPECT_EQ( sim.miner_profit > 0, true );
+   EXPECT_EQ( sim.owner_space, 100 * one_gb );
+
+   // 停用后再增加空间，矿机保持不活跃，收益账号不计入，不能再次停用
+   EXPECT_EQ( sim.deactive(), true );
+   EXPECT_EQ( sim.owner_space, 0 );
+   sim.add( 1 );
+   EXPECT_EQ( sim.miner_profit, 0 );
+   EXPECT_EQ( sim.miner_space, 100 * one_gb + 1 );
+   EXPECT_EQ( sim.owner_space, 0 );
+   EXPECT_EQ( sim.deactive(), false );
+   EXPECT_EQ( sim.owner_space, 0 );
+
+   // 重新启用后计入全部生产空间，再停用回到0
+   EXPECT_EQ( sim.active(), true );
+   EXPECT_EQ( sim.owner_space, 100 * one_gb + 1 );
+   EXPECT_EQ( sim.deactive(), true );
+   EXPECT_EQ( sim.owner_space, 0 );
+
+   // 扣除超过收益账号生产空间时报错，不会回绕
+   bool thrown = false;
+   try {
+      move_owner_space( 1, 100 * one_gb, 0 );
+   } catch ( const std::exception& ) {
+      thrown = true;
+   }
+   EXPECT_EQ( thrown, true );
+}
+
+int main()
+{
+   test_hddm_per_cycle_profit();
+   test_buy_token_amount();
+   test_sell_token_amount();
+   test_deposit_required();
+   test_calculate_balance();
+   test_owner_space();
+
+   if ( failures > 0 ) {
+      printf( "%d failures\n", failures );
+      return 1;
+   }
+   printf( "all billing tests passed\n" );
+   return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// 链下测试用的最小 eosio 头文件，只提供计费公式用到的部分
+
+#include <cstdint>
+#include <stdexcept>
+
+typedef unsigned __int128 uint128_t;
+typedef __int128 int128_t;
+
+namespace eosio {
+
+   inline void check( bool pred, const char* msg )
+   {
+      if ( !pred ) {
+         throw std::runtime_error( msg );
+      }
+   }
+
+} // namespace eosio
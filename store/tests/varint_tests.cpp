@@ -0,0 +1,235 @@
+// 变长整数编码和 usersv2 压缩行的编解码往返测试
+// 编译运行: ./compile.sh test
+
+#include <compact_user.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static int failures = 0;
+
+#define EXPECT_EQ( actual, expected ) \
+   do { \
+      unsigned long long a_ = (unsigned long long)(actual), e_ = (unsigned long long)(expected); \
+      if ( a_ != e_ ) { \
+         printf( "%s:%d: %s = %llu, expected %llu\n", __FILE__, __LINE__, #actual, a_, e_ ); \
+         failures++; \
+      } \
+   } while ( 0 )
+
+/**
+ * 与 eosio::datastream 相同的读写接口，读取越界时报错
+ */
+struct buffer_stream {
+   std::vector<char>  buf;
+   size_t             pos = 0;
+
+   void write( const char* d, size_t n )
+   {
+      buf.insert( buf.end(), d, d + n );
+   }
+
+   void read( char* d, size_t n )
+   {
+      eosio::check( pos + n <= buf.size(), "datastream attempted to read past the end" );
+      memcpy( d, buf.data() + pos, n );
+      pos += n;
+   }
+
+   size_t remaining() const { return buf.size() - pos; }
+};
+
+// 定长字段按小端写入，与 datastream 相同
+template<typename T>
+buffer_stream& operator<<( buffer_stream& ds, const T& v )
+{
+   char b[sizeof(T)];
+   for ( size_t i = 0; i < sizeof(T); i++ ) {
+      b[i] = char( uint64_t(v) >> ( 8 * i ) );
+   }
+   ds.write( b, sizeof(T) );
+   return ds;
+}
+
+template<typename T>
+buffer_stream& operator>>( buffer_stream& ds, T& v )
+{
+   char b[sizeof(T)];
+   ds.read( b, sizeof(T) );
+   uint64_t u = 0;
+   for ( size_t i = 0; i < sizeof(T); i++ ) {
+      u |= uint64_t( uint8_t(b[i]) ) << ( 8 * i );
+   }
+   v = T(u);
+   return ds;
+}
+
+/**
+ * 字段与 store::user_v2 相同，owner 按 name 的64位值保存
+ */
+struct test_user {
+   uint64_t    owner = 0;
+
+   int64_t     hdds = 0;
+   uint64_t    used_space = 0;
+   uint64_t    hdds_per_cycle_fee = 0;
+   uint32_t    hdds_last_update_time = 0;
+
+   int64_t     hddm = 0;
+   uint64_t    prod_space = 0;
+   uint64_t    hddm_per_cycle_profit = 0;
+   uint32_t    hddm_last_update_time = 0;
+   uint64_t    hddm_acc_snapshot = 0;
+};
+
+static size_t packed_u64_size( uint64_t v )
+{
+   buffer_stream ds;
+   varint::pack_u64( ds, v );
+   return ds.buf.size();
+}
+
+static size_t packed_i64_size( int64_t v )
+{
+   buffer_stream ds;
+   varint::pack_i64( ds, v );
+   return ds.buf.size();
+}
+
+static bool unpack_throws( const std::vector<char>& bytes )
+{
+   buffer_stream ds;
+   ds.buf = bytes;
+   try {
+      varint::unpack_u64( ds );
+   } catch ( const std::exception& ) {
+      return true;
+   }
+   return false;
+}
+
+static void test_varint_u64()
+{
+   const uint64_t values[] = { 0, 1, 127, 128, 16383, 16384, 1ull << 32, ( 1ull << 63 ) - 1, 1ull << 63, UINT64_MAX };
+   buffer_stream ds;
+   for ( uint64_t v : values ) {
+      varint::pack_u64( ds, v );
+   }
+   for ( uint64_t v : values ) {
+      EXPECT_EQ( varint::unpack_u64( ds ), v );
+   }
+   EXPECT_EQ( ds.remaining(), 0 );
+
+   EXPECT_EQ( packed_u64_size( 0 ), 1 );
+   EXPECT_EQ( packed_u64_size( 127 ), 1 );
+   EXPECT_EQ( packed_u64_size( 128 ), 2 );
+   EXPECT_EQ( packed_u64_size( 16384 ), 3 );
+   EXPECT_EQ( packed_u64_size( UINT64_MAX ), 10 );
+
+   // 超过64位和数据不完整时报错
+   EXPECT_EQ( unpack_throws( std::vector<char>( 10, char(0x80) ) ), true );
+   EXPECT_EQ( unpack_throws( { char(0x80), char(0x80) } ), true );
+}
+
+static void test_varint_i64()
+{
+   const int64_t values[] = { 0, -1, 1, -64, 63, -65, 64, INT64_MIN, INT64_MAX, -( 1ll << 62 ) + 1, ( 1ll << 62 ) - 1 };
+   buffer_stream ds;
+   for ( int64_t v : values ) {
+      varint::pack_i64( ds, v );
+   }
+   for ( int64_t v : values ) {
+      EXPECT_EQ( varint::unpack_i64( ds ), v );
+   }
+   EXPECT_EQ( ds.remaining(), 0 );
+
+   // 绝对值小的负数同样只占1个字节
+   EXPECT_EQ( packed_i64_size( -1 ), 1 );
+   EXPECT_EQ( packed_i64_size( -64 ), 1 );
+   EXPECT_EQ( packed_i64_size( -65 ), 2 );
+   EXPECT_EQ( packed_i64_size( INT64_MIN ), 10 );
+}
+
+static void expect_round_trip( const test_user& u, size_t expected_size )
+{
+   buffer_stream ds;
+   compact_user::pack( ds, u );
+   EXPECT_EQ( ds.buf.size(), expected_size );
+
+   test_user r;
+   compact_user::unpack( ds, r );
+   EXPECT_EQ( ds.remaining(), 0 );
+   EXPECT_EQ( r.owner, u.owner );
+   EXPECT_EQ( r.hdds, u.hdds );
+   EXPECT_EQ( r.used_space, u.used_space );
+   EXPECT_EQ( r.hdds_per_cycle_fee, u.hdds_per_cycle_fee );
+   EXPECT_EQ( r.hdds_last_update_time, u.hdds_last_update_time );
+   EXPECT_EQ( r.hddm, u.hddm );
+   EXPECT_EQ( r.prod_space, u.prod_space );
+   EXPECT_EQ( r.hddm_per_cycle_profit, u.hddm_per_cycle_profit );
+   EXPECT_EQ( r.hddm_last_update_time, u.hddm_last_update_time );
+   EXPECT_EQ( r.hddm_acc_snapshot, u.hddm_acc_snapshot );
+}
+
+static void test_compact_user()
+{
+   // 新开户的用户：owner 8 + 两个时间 4*2 + 其余7个字段各1字节
+   test_user fresh;
+   fresh.owner = 0x5530ea033c80a555ull;
+   fresh.hdds_last_update_time = 1700000000;
+   fresh.hddm_last_update_time = 1700000000;
+   expect_round_trip( fresh, 23 );
+
+   // 普通用户
+   test_user typical = fresh;
+   typical.hdds = -123456789;
+   typical.used_space = 100 * 65536;
+   typical.hdds_per_cycle_fee = 27397260;
+   typical.hddm = 987654321012;
+   typical.prod_space = 1024 * 65536;
+   typical.hddm_per_cycle_profit = 280547945;
+   typical.hddm_acc_snapshot = 4186763171893ull;
+   expect_round_trip( typical, 49 );
+
+   // 所有字段取上限时最长，8 + 7*10 + 4*2 = 86 字节，比定长格式的80字节多6字节
+   test_user extreme;
+   extreme.owner = UINT64_MAX;
+   extreme.hdds = INT64_MIN;
+   extreme.used_space = UINT64_MAX;
+   extreme.hdds_per_cycle_fee = UINT64_MAX;
+   extreme.hdds_last_update_time = UINT32_MAX;
+   extreme.hddm = INT64_MAX;
+   extreme.prod_space = UINT64_MAX;
+   extreme.hddm_per_cycle_profit = UINT64_MAX;
+   extreme.hddm_last_update_time = UINT32_MAX;
+   extreme.hddm_acc_snapshot = UINT64_MAX;
+   expect_round_trip( extreme, 86 );
+
+   // 行数据不完整时报错
+   buffer_stream ds;
+   compact_user::pack( ds, typical );
+   ds.buf.pop_back();
+   test_user r;
+   bool thrown = false;
+   try {
+      compact_user::unpack( ds, r );
+   } catch ( const std::exception& ) {
+      thrown = true;
+   }
+   EXPECT_EQ( thrown, true );
+}
+
+int main()
+{
+   test_varint_u64();
+   test_varint_i64();
+   test_compact_user();
+
+   if ( failures > 0 ) {
+      printf( "%d failures\n", failures );
+      return 1;
+   }
+   printf( "all varint tests passed\n" );
+   return 0;
+}